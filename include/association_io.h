@@ -0,0 +1,282 @@
+// -*- mode: c++ -*-
+
+#ifndef ASSOCIATION_IO_H
+#define ASSOCIATION_IO_H
+
+#include <valhalla/baldr/graphid.h>
+#include <valhalla/baldr/tilehierarchy.h>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// what valhalla_associate_segments keeps on disk while it runs, the journal that lets it be
+// resumed along with the staging of graph tile writes that makes resuming safe, and the sorted
+// runs leftovers are spilled to
+namespace association {
+
+namespace vb = valhalla::baldr;
+namespace bfs = boost::filesystem;
+
+// a whole edge covered by a segment which has to be written to some other graph tile
+struct leftover {
+  vb::GraphId edge, segment;
+  bool starts, ends;
+};
+
+// the part of a segment which covers only some fraction of an edge. these come from segments
+// which don't start or end at graph nodes and get merged per edge once all threads are done
+struct partial_chunk {
+  vb::GraphId edge, segment;
+  float begin, end;
+  bool starts, ends;
+};
+
+using leftovers_t = std::vector<leftover>;
+using partials_t = std::vector<partial_chunk>;
+
+// records are written field by field, little endian and at a fixed size whatever the compiler
+// does with the structs above, so a file is either read back exactly or refused
+void put_u8(std::string& out, uint8_t value);
+void put_u32(std::string& out, uint32_t value);
+void put_u64(std::string& out, uint64_t value);
+void put(std::string& out, const leftover& record);
+void put(std::string& out, const partial_chunk& record);
+
+// these read from pos and move it along, or return false if there arent enough bytes left
+bool get_u8(const char*& pos, const char* end, uint8_t& value);
+bool get_u32(const char*& pos, const char* end, uint32_t& value);
+bool get_u64(const char*& pos, const char* end, uint64_t& value);
+bool get(const char*& pos, const char* end, leftover& record);
+bool get(const char*& pos, const char* end, partial_chunk& record);
+
+// how many bytes put writes for each kind of record
+template <class record_t> struct record_size;
+template <> struct record_size<leftover> { static constexpr size_t value = 17; };
+template <> struct record_size<partial_chunk> { static constexpr size_t value = 25; };
+
+// what every journal starts with, a journal with anything else in front of it was written by
+// some other version of the tool and cant be resumed from
+constexpr uint32_t kJournalMagic = 0x4c4e524a; // JRNL
+constexpr uint32_t kJournalVersion = 2;
+
+// where graph tiles are written before they replace the real ones, next to the graph tiles so
+// that moving them into place is a rename
+constexpr char kStagingName[] = "segment_associations.staging";
+
+// the round the local associations of an osmlr tile are written in, leftovers are written in
+// rounds named after how many osmlr tiles were done when the writer took them
+constexpr char kLocalRound[] = "local";
+
+// rewriting a graph tile in place isnt something a crash can be recovered from, it could be half
+// written or it could be written but not journaled so that resuming writes the same associations
+// into it again. so the tile is copied off to the side, written there and synced, the journal
+// records that it was, and only then is the copy moved over the real tile. resuming commits every
+// copy the journal has a record of and throws the rest away, so each write lands exactly once
+class staging_t {
+ public:
+  explicit staging_t(const vb::TileHierarchy& hierarchy);
+
+  // copy the tile to where this round writes it, false if there is no such tile
+  bool stage(const vb::GraphId& tile_id, const std::string& round) const;
+
+  // the directory that, used as a tile_dir, points a tile builder at this round's copies
+  std::string directory(const std::string& round) const;
+
+  // make sure what was written to the copy is on disk before the journal says it is there
+  void sync(const vb::GraphId& tile_id, const std::string& round) const;
+
+  // move the copy over the real tile, the directory is synced too so a later round of the same
+  // tile cant end up on disk before this one does. false if there was nothing to move
+  bool commit(const vb::GraphId& tile_id, const std::string& round) const;
+
+  // throw away whatever was staged, nothing the journal doesnt know about can be trusted
+  void clear() const;
+
+ private:
+  const vb::TileHierarchy& m_hierarchy;
+  bfs::path m_root;
+};
+
+// an append only record of which osmlr tiles are done, what they left over for other tiles and
+// which tiles got their leftovers written. every record is synced to disk before we go on so a
+// run that dies part way through can pick up where it left off. a record is also what lets the
+// staged copy of the graph tile it is about be committed, see staging_t. records can be appended
+// from any thread
+class journal_t {
+ public:
+  // what an interrupted run got done
+  struct done_t {
+    vb::GraphId source;
+    std::vector<vb::GraphId> targets;
+    leftovers_t leftovers;
+    partials_t partials;
+  };
+
+  // start a new journal or, when resuming, read the one that is there and carry on appending to
+  // it. throws if the journal there was written by a different version
+  journal_t(const std::string& file_name, bool resume);
+  ~journal_t();
+  journal_t(const journal_t&) = delete;
+  journal_t& operator=(const journal_t&) = delete;
+
+  // how many osmlr tiles have been recorded as done
+  uint64_t done_count() const { return m_done; }
+
+  void done(const vb::GraphId& source, const std::vector<vb::GraphId>& targets, const leftovers_t& leftovers,
+            const partials_t& partials);
+
+  // the leftovers of the first done_count osmlr tiles are all written to the staged copy of this
+  // tile in the round named after done_count
+  void flushed(const vb::GraphId& tile_id, uint64_t done_count);
+
+  // the graph tiles from a previous run have been copied in
+  void copied_forward();
+
+  // what a graph tile hashed to before anything was written to it
+  void hashed(const vb::GraphId& tile_id, uint64_t hash);
+
+  // what was read back when resuming, in the order it was done
+  std::vector<done_t> finished;
+  std::unordered_map<vb::GraphId, uint64_t> flushed_upto;
+  std::unordered_map<vb::GraphId, uint64_t> hashes;
+  bool copied;
+
+ private:
+  void append(const std::string& record);
+  // returns how many bytes of the file are good, the rest is what a crash cut short
+  size_t read(const std::string& data);
+
+  std::mutex m_lock;
+  int m_fd;
+  uint64_t m_done;
+};
+
+// what every spilled run starts with. runs only live as long as the process that wrote them but
+// a run that isnt one of ours is still better refused than merged
+constexpr uint32_t kRunMagic = 0x4e555253; // SRUN
+constexpr uint32_t kRunVersion = 1;
+
+// how many leftovers of each kind a thread holds on to before it sorts them and spills them to disk
+constexpr size_t kSpillRecords = 1 << 20;
+
+// spilled records are sorted and merged by the tile they need to be written to
+uint64_t spill_key(const leftover& association);
+uint64_t spill_key(const partial_chunk& chunk);
+
+// the header of a run and checking it, throws if the run was written by something else
+std::string run_header();
+void check_run_header(std::istream& in, const std::string& file_name);
+
+// buffers records and writes them out as sorted run files
+template <class record_t>
+class run_writer {
+ public:
+  explicit run_writer(const std::string& prefix) : m_prefix(prefix) {}
+
+  void add(record_t&& record) {
+    m_buffer.emplace_back(std::move(record));
+    if (m_buffer.size() >= kSpillRecords)
+      flush();
+  }
+
+  // sort what is buffered and write it out as a run of its own, records with the same key stay
+  // in the order they were added
+  void flush() {
+    if (m_buffer.empty())
+      return;
+    std::stable_sort(m_buffer.begin(), m_buffer.end(), [](const record_t& a, const record_t& b) {
+      return spill_key(a) < spill_key(b); });
+    std::string data = run_header();
+    data.reserve(data.size() + m_buffer.size() * record_size<record_t>::value);
+    for (const auto& record : m_buffer)
+      put(data, record);
+    m_files.push_back(m_prefix + "." + std::to_string(m_files.size()));
+    std::ofstream out(m_files.back(), std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    if (!out)
+      throw std::runtime_error("Unable to write leftovers to " + m_files.back());
+    m_buffer.clear();
+  }
+
+  const std::vector<std::string>& files() const { return m_files; }
+
+ private:
+  std::string m_prefix;
+  std::vector<record_t> m_buffer;
+  std::vector<std::string> m_files;
+};
+
+// k-way merge of sorted run files, hands back all the records for one tile at a time. throws if
+// a run isnt one of ours or ends part way through a record
+template <class record_t>
+class run_merger {
+ public:
+  explicit run_merger(const std::vector<std::string>& files) : m_runs(files.size()) {
+    for (size_t i = 0; i < files.size(); ++i) {
+      m_runs[i].file_name = files[i];
+      m_runs[i].in.open(files[i], std::ios::binary);
+      check_run_header(m_runs[i].in, files[i]);
+      advance(i);
+    }
+  }
+
+  // the smallest tile any run still has records for
+  bool peek(uint64_t& key) const {
+    if (m_heap.empty())
+      return false;
+    key = m_heap.top().first;
+    return true;
+  }
+
+  // move every record for this tile out of the runs
+  void take(uint64_t key, std::vector<record_t>& records) {
+    while (m_heap.size() && m_heap.top().first == key) {
+      auto run = m_heap.top().second;
+      m_heap.pop();
+      records.emplace_back(std::move(m_runs[run].record));
+      advance(run);
+    }
+  }
+
+ private:
+  struct run_t {
+    std::string file_name;
+    std::ifstream in;
+    record_t record;
+  };
+
+  void advance(size_t run) {
+    auto& r = m_runs[run];
+    char bytes[record_size<record_t>::value];
+    r.in.read(bytes, sizeof(bytes));
+    if (r.in.gcount() == 0 && r.in.eof())
+      return;
+    const char* pos = bytes;
+    if (r.in.gcount() != std::streamsize(sizeof(bytes)) || !get(pos, bytes + sizeof(bytes), r.record))
+      throw std::runtime_error("Leftovers in " + r.file_name + " end part way through a record");
+    m_heap.emplace(spill_key(r.record), run);
+  }
+
+  using entry_t = std::pair<uint64_t, size_t>;
+  std::vector<run_t> m_runs;
+  std::priority_queue<entry_t, std::vector<entry_t>, std::greater<entry_t> > m_heap;
+};
+
+// finish moving whatever the journal says was written into place and throw away the rest of the
+// staging area. returns how many graph tiles were moved
+size_t recover(const journal_t& journal, const staging_t& staging);
+
+}
+
+#endif // ASSOCIATION_IO_H
@@ -0,0 +1,324 @@
+// -*- mode: c++ -*-
+
+#ifndef EDGE_ASSOCIATION_H
+#define EDGE_ASSOCIATION_H
+
+#include <valhalla/baldr/graphreader.h>
+#include <valhalla/baldr/pathlocation.h>
+#include <valhalla/mjolnir/graphtilebuilder.h>
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "segment.pb.h"
+#include "tile.pb.h"
+#include "segment_association.h"
+#include "association_io.h"
+
+// matching the segments of an osmlr tile to graph edges, shared by valhalla_associate_segments
+// and its benchmark
+namespace association {
+
+namespace vj = valhalla::mjolnir;
+namespace bpt = boost::property_tree;
+
+// how matching a segment turned out, either which strategy found its edges or why none did
+enum class outcome : uint8_t {
+  kCommonEdge = 0,
+  kWalked,
+  kRouted,
+  kNoOriginNode,
+  kNoDestinationNode,
+  kNoEdgeNearPoint,
+  kNoRoute,
+  kRouteEndsTooFar,
+  kNotAccessible,
+  kNotAtOrigin,
+  kCount
+};
+
+constexpr const char *outcome_names[] = {
+  "common_edge", "walked", "routed", "no_origin_node", "no_destination_node", "no_edge_near_point",
+  "no_route", "route_ends_too_far", "not_accessible", "not_at_origin"
+};
+static_assert(sizeof(outcome_names) / sizeof(outcome_names[0]) == size_t(outcome::kCount),
+              "every outcome needs a name");
+
+using steady_clock = std::chrono::steady_clock;
+
+inline uint64_t micros_since(const steady_clock::time_point &start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(steady_clock::now() - start).count();
+}
+
+// counts and a log2 histogram of how many microseconds something took
+struct histogram {
+  static constexpr size_t kBuckets = 32;
+
+  histogram() : count(0), total(0), max(0) { buckets.fill(0); }
+
+  void add(uint64_t micros) {
+    size_t bucket = 0;
+    while (bucket + 1 < kBuckets && (uint64_t(1) << bucket) <= micros)
+      ++bucket;
+    ++buckets[bucket];
+    ++count;
+    total += micros;
+    max = std::max(max, micros);
+  }
+
+  void merge(const histogram &other) {
+    for (size_t i = 0; i < kBuckets; ++i)
+      buckets[i] += other.buckets[i];
+    count += other.count;
+    total += other.total;
+    max = std::max(max, other.max);
+  }
+
+  bpt::ptree to_ptree() const {
+    bpt::ptree tree, histo;
+    tree.put("count", count);
+    tree.put("total_us", total);
+    tree.put("mean_us", count ? total / count : 0);
+    tree.put("max_us", max);
+    //bucket i holds everything under 2^i microseconds that didnt fit in the bucket before it
+    for (size_t i = 0; i < kBuckets; ++i) {
+      if (buckets[i] == 0)
+        continue;
+      bpt::ptree bucket;
+      bucket.put("under_us", uint64_t(1) << i);
+      bucket.put("count", buckets[i]);
+      histo.push_back(std::make_pair("", bucket));
+    }
+    tree.add_child("histogram", histo);
+    return tree;
+  }
+
+  uint64_t count, total, max;
+  std::array<uint64_t, kBuckets> buckets;
+};
+
+// where the time went. every thread keeps its own and they are all merged at the end
+struct metrics_t {
+  static constexpr size_t kSlowest = 25;
+
+  struct slow_segment {
+    uint64_t micros;
+    vb::GraphId segment;
+    outcome result;
+    bool operator>(const slow_segment &other) const { return micros > other.micros; }
+  };
+
+  void matched(const vb::GraphId &segment, outcome result, uint64_t micros) {
+    outcomes[size_t(result)].add(micros);
+    keep_if_slow(slow_segment{micros, segment, result});
+    if (sampling)
+      samples.push_back(micros);
+  }
+
+  void merge(const metrics_t &other) {
+    for (size_t i = 0; i < outcomes.size(); ++i)
+      outcomes[i].merge(other.outcomes[i]);
+    load.merge(other.load);
+    search.merge(other.search);
+    match.merge(other.match);
+    write.merge(other.write);
+    leftovers.merge(other.leftovers);
+    cache_clears += other.cache_clears;
+    for (const auto &segment : other.slowest)
+      keep_if_slow(segment);
+    samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+  }
+
+  bpt::ptree to_ptree() const {
+    bpt::ptree tree, results, stages, slow;
+    for (size_t i = 0; i < outcomes.size(); ++i)
+      results.add_child(outcome_names[i], outcomes[i].to_ptree());
+    stages.add_child("load", load.to_ptree());
+    stages.add_child("search", search.to_ptree());
+    stages.add_child("match", match.to_ptree());
+    stages.add_child("write", write.to_ptree());
+    stages.add_child("leftovers", leftovers.to_ptree());
+    auto sorted = slowest;
+    std::sort(sorted.begin(), sorted.end(), std::greater<slow_segment>());
+    for (const auto &segment : sorted) {
+      bpt::ptree entry;
+      entry.put("segment_id", segment.segment.value);
+      entry.put("tile_id", segment.segment.tileid());
+      entry.put("level", segment.segment.level());
+      entry.put("id", segment.segment.id());
+      entry.put("outcome", outcome_names[size_t(segment.result)]);
+      entry.put("us", segment.micros);
+      slow.push_back(std::make_pair("", entry));
+    }
+    tree.add_child("outcomes", results);
+    tree.add_child("stages", stages);
+    tree.put("cache_clears", cache_clears);
+    tree.add_child("slowest_segments", slow);
+    return tree;
+  }
+
+  // per segment, by how it turned out
+  std::array<histogram, size_t(outcome::kCount)> outcomes;
+  // per osmlr tile: mapping it and loading its graph tile, the batch search of its
+  // locations, matching its segments and writing its local associations. and per
+  // graph tile that got leftovers, writing those
+  histogram load, search, match, write, leftovers;
+  // how many times a thread's graph tile cache filled up and was thrown away, every tile it
+  // needs after that is read from disk again
+  uint64_t cache_clears = 0;
+  std::vector<slow_segment> slowest;
+  // every segment's time when sampling, for exact percentiles rather than histogram buckets
+  bool sampling = false;
+  std::vector<uint64_t> samples;
+
+ private:
+  // the slowest are kept in a min heap so the quickest of them is the one to go
+  void keep_if_slow(const slow_segment &segment) {
+    if (slowest.size() == kSlowest && segment.micros <= slowest.front().micros)
+      return;
+    slowest.push_back(segment);
+    std::push_heap(slowest.begin(), slowest.end(), std::greater<slow_segment>());
+    if (slowest.size() > kSlowest) {
+      std::pop_heap(slowest.begin(), slowest.end(), std::greater<slow_segment>());
+      slowest.pop_back();
+    }
+  }
+};
+
+// how much worse than the best origin candidate another one can score and still be routed from
+constexpr float kCandidateSlack = 10.0f;
+
+// the edges an lrp could start on, kept as one array per property so scoring all of them is a
+// single loop over floats with no branches that the compiler can vectorise
+struct candidate_scores {
+  void clear() {
+    distance.clear();
+    heading.clear();
+    road_class.clear();
+    form_of_way.clear();
+  }
+
+  void add(float dist, float bear, float rclass, float fow) {
+    distance.push_back(dist);
+    heading.push_back(bear);
+    road_class.push_back(rclass);
+    form_of_way.push_back(fow);
+  }
+
+  // score every candidate against the lrp, lower is better. returns the index of the best one.
+  // the weights are the ones the route score has always used, whole meters away from the lrp,
+  // whole tens of degrees off its bearing, road classes apart and 5 for the wrong form of way, so
+  // every term is a whole number and adding the score to the route's loses nothing
+  size_t score(const pbf::Segment::LocationReference &lrp) {
+    const size_t n = distance.size();
+    scores.resize(n);
+    const float bear = float(lrp.bear()), rclass = float(lrp.start_frc()), fow = float(lrp.start_fow());
+    const float *d = distance.data(), *h = heading.data(), *c = road_class.data(), *f = form_of_way.data();
+    float *out = scores.data();
+    for (size_t i = 0; i < n; ++i) {
+      float bear_diff = std::abs(std::floor(h[i]) - bear);
+      bear_diff = std::min(bear_diff, 360.0f - bear_diff);
+      out[i] = std::floor(d[i]) + std::floor(bear_diff / 10.0f) + std::abs(c[i] - rclass) + (f[i] == fow ? 0.0f : 5.0f);
+    }
+    return std::min_element(scores.begin(), scores.end()) - scores.begin();
+  }
+
+  std::vector<float> distance, heading, road_class, form_of_way, scores;
+};
+
+// matches the segments of osmlr tiles to the edges of the graph, one per thread
+struct edge_association {
+  edge_association(const bpt::ptree &pt, metrics_t &metrics);
+
+  // match the segments of an osmlr tile. the ones which land in the graph tile of the same id
+  // are written to it unless write_local is false, everything else is kept for later. they go
+  // to that tile under write_to when given rather than under the reader's tile_dir
+  void add_tile(const std::string &file_name, bool write_local = true, const vb::TileHierarchy *write_to = nullptr);
+  // hand over what has to be written to other tiles or merged with what other threads found
+  leftovers_t take_leftovers();
+  partials_t take_partials();
+
+private:
+  void match_segment(vb::GraphId segment_id, const pbf::Segment &segment);
+  std::vector<vb::GraphId> match_edges(const pbf::Segment &segment, uint8_t level, outcome &result);
+  vm::PointLL lookup_end_coord(const vb::GraphId& edge_id);
+  vm::PointLL lookup_start_coord(const vb::GraphId& edge_id);
+  void search_entries(size_t count, uint8_t level);
+  vb::PathLocation search(const vb::Location &loc, uint8_t level);
+
+  void assign_one_to_one(const vb::GraphId& edge_id, const vb::GraphId& segment_id);
+  void assign_one_to_many(const std::vector<vb::GraphId> &edges, const vb::GraphId& segment_id);
+  void save_chunk_for_later(const std::vector<vb::GraphId> &edges, const vb::GraphId& segment_id,
+                            const vm::PointLL &seg_start, const vm::PointLL &seg_end);
+
+  vb::GraphReader m_reader;
+  // bounded routes between lrps and somewhere to put them
+  segment_router<> m_router;
+  std::vector<vb::GraphId> m_route, m_candidate_route;
+  // the graph tile of the osmlr tile being matched and, when its local associations are being
+  // written, a builder for it
+  vb::GraphId m_tile_id;
+  std::shared_ptr<vj::GraphTileBuilder> m_tile_builder;
+  const vb::GraphTile* m_tile;
+  // chunks saved for later
+  partials_t m_partial_chunks;
+  // simple associations saved for later
+  leftovers_t m_leftover_associations;
+  // nodes of the graph tiles we've looked in so far
+  node_finder m_nodes;
+  common_edge_finder m_common_edges;
+  // bearings of the edges we've been scoring
+  bearing_cache m_bearings;
+  // the origin edges of the lrp we are matching and the edges of them worth routing from
+  candidate_scores m_candidates;
+  // where the time went
+  metrics_t &m_metrics;
+  // the entries of the osmlr tile being matched, reused so they keep their allocations
+  std::vector<pbf::Tile::Entry> m_entries;
+  // loki results for the locations of those entries
+  std::unordered_map<vb::Location, vb::PathLocation> m_search_cache;
+  uint8_t m_search_level;
+};
+
+// most batches will be this big, small extracts get smaller ones so every thread has some work
+constexpr size_t kMaxTilesPerBatch = 16;
+
+// a group of spatially adjacent osmlr tiles which should be worked on by the same thread
+using tile_batch_t = std::vector<std::string>;
+
+// each thread has its own queue of batches. the owner takes batches from the front and other
+// threads, once they have run out of their own work, steal batches from the back
+struct work_queue {
+  std::mutex lock;
+  std::deque<tile_batch_t> batches;
+};
+
+// the next batch for this thread, its own or one stolen from another. false once there are none
+bool take_batch(std::vector<work_queue>& queues, size_t self, tile_batch_t& batch);
+
+// order the osmlr tiles by area, or level by level when by_area is false, and cut them up into
+// batches so that the tiles in a batch are next to each other and share most of their graph
+// tiles, see the definition for the order. the batches are sized so that each of num_threads
+// threads gets a few of them
+std::vector<tile_batch_t> make_batches(const vb::TileHierarchy& hierarchy, std::vector<std::string> file_names,
+  size_t num_threads, bool by_area = true);
+
+// hand out contiguous runs of the batches, so each thread starts in an area of its own
+void deal_batches(std::vector<tile_batch_t> batches, std::vector<work_queue>& queues);
+
+vb::GraphId parse_file_name(const std::string &file_name);
+
+}
+
+#endif // EDGE_ASSOCIATION_H
@@ -0,0 +1,427 @@
+// -*- mode: c++ -*-
+
+#ifndef SEGMENT_ASSOCIATION_H
+#define SEGMENT_ASSOCIATION_H
+
+#include <valhalla/midgard/pointll.h>
+#include <valhalla/midgard/aabb2.h>
+#include <valhalla/baldr/graphreader.h>
+#include <valhalla/baldr/pathlocation.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <google/protobuf/io/coded_stream.h>
+
+#include "segment.pb.h"
+#include "tile.pb.h"
+
+// the pieces of valhalla_associate_segments which are shared with its benchmarks
+namespace association {
+
+namespace vm = valhalla::midgard;
+namespace vb = valhalla::baldr;
+namespace pbf = opentraffic::osmlr;
+
+// be permissive here, as we do want to collect traffic on most vehicular
+// routes.
+constexpr uint32_t vehicular = vb::kAutoAccess | vb::kTruckAccess |
+    vb::kTaxiAccess | vb::kBusAccess | vb::kHOVAccess;
+
+// these are asked about every edge the router expands so they live here where it can inline them
+inline bool edge_pred(const vb::DirectedEdge *edge) {
+  return (edge->use() != vb::Use::kFerry &&
+          edge->use() != vb::Use::kTransitConnection &&
+          !edge->trans_up() &&
+          !edge->trans_down());
+}
+
+inline bool check_access(const vb::DirectedEdge *edge) {
+  uint32_t access = vb::kAllAccess;
+  access &= edge->forwardaccess();
+
+  // if any edge is a shortcut, then drop the whole path
+  if (edge->is_shortcut()) {
+    return false;
+  }
+
+  // if the edge predicate is false for any edge, then drop the whole
+  // path.
+  if (edge_pred(edge) == false) {
+    return false;
+  }
+
+  return access & vehicular;
+}
+
+// how much longer than an lrp says it is we'll let a route between its ends be
+// before giving up on it. the slack is for short lrps whose ends were snapped
+constexpr float kMaxRouteFactor = 1.5f;
+constexpr float kRouteSlack = 50.0f;
+
+vm::PointLL coord_for_lrp(const pbf::Segment::LocationReference &lrp);
+
+vb::Location location_for_lrp(const pbf::Segment::LocationReference &lrp);
+
+float search_filter(const vb::DirectedEdge* edge, uint8_t level);
+
+// walks the entries of an osmlr tile straight out of the mapped file in a single pass, so
+// only the entries being looked at are ever parsed and held in memory
+class osmlr_reader {
+ public:
+  explicit osmlr_reader(const std::string &file_name);
+  ~osmlr_reader();
+  osmlr_reader(const osmlr_reader&) = delete;
+  osmlr_reader& operator=(const osmlr_reader&) = delete;
+
+  // parse the next entry into entry, reusing whatever it already allocated. returns
+  // false once there are no entries left
+  bool next(pbf::Tile::Entry &entry);
+  // parse up to count of the next entries into the front of entries, growing it if need
+  // be and reusing what is already there. returns how many were parsed, 0 at the end
+  size_t next(std::vector<pbf::Tile::Entry> &entries, size_t count);
+
+ private:
+  std::string m_file_name;
+  const uint8_t *m_data;
+  size_t m_size;
+  // one stream over the whole file, its byte limit is raised so big tiles dont trip it
+  std::unique_ptr<google::protobuf::io::CodedInputStream> m_in;
+};
+
+// how many osmlr entries are parsed and searched for at a time, enough that loki sees most
+// of the points neighbouring segments share in the same search
+constexpr size_t kEntriesPerSearch = 1024;
+
+// all the locations the first count entries will need searched, each one only once
+std::vector<vb::Location> locations_for_entries(const std::vector<pbf::Tile::Entry> &entries, size_t count);
+
+vm::AABB2<vm::PointLL> expand_bbox_at_point(float dist, const vm::PointLL &pt);
+
+// a node along with where its edges are in its tile
+struct node_ref {
+  vb::GraphId id;
+  uint32_t edge_index, edge_count;
+};
+
+// the nodes of one graph tile bucketed into a flat grid over the tile, so that
+// a small radius query only has to look at a handful of cells. coordinates are
+// kept in separate arrays so filtering a cell is a tight loop over floats
+class node_index {
+ public:
+  node_index() : m_size(0) {}
+  node_index(const vb::GraphTile *tile, const vm::AABB2<vm::PointLL> &bounds);
+
+  // add the nodes within dist meters of pt to nodes
+  void within(const vm::PointLL &pt, float dist, std::vector<node_ref> &nodes) const;
+
+ private:
+  uint32_t cell(float x, float y) const;
+
+  vb::GraphId m_tile_id;
+  uint32_t m_size;
+  float m_minx, m_miny, m_cell_width, m_cell_height;
+  // where each cell's nodes start in the arrays below, plus one past the end
+  std::vector<uint32_t> m_cells;
+  std::vector<float> m_lngs, m_lats;
+  std::vector<uint32_t> m_ids, m_edge_indices, m_edge_counts;
+};
+
+// finds graph nodes near a point, indexing each graph tile the first time it
+// is looked in. the indices have to be cleared along with the reader's cache
+class node_finder {
+ public:
+  std::vector<node_ref> within(vb::GraphReader &reader, float dist, const vm::PointLL &pt);
+  void clear();
+
+ private:
+  const node_index& index_for(vb::GraphReader &reader, const vb::GraphId &tile_id);
+
+  std::unordered_map<vb::GraphId, node_index> m_indices;
+};
+
+// finds the one edge, if there is exactly one, which goes from one of the
+// origin nodes to one of the destination nodes. it keeps its scratch space
+// between calls so once it has warmed up it doesn't allocate at all
+class common_edge_finder {
+ public:
+  vb::GraphId find(vb::GraphReader &reader, const std::vector<node_ref> &origins,
+                   const std::vector<node_ref> &dests);
+
+ private:
+  // the edges leaving the origin nodes, sorted
+  std::vector<vb::GraphId> m_start_edges;
+  // the edges leaving the destination nodes along with the tile their end node is in
+  std::vector<std::pair<vb::GraphId, const vb::DirectedEdge*> > m_dest_edges;
+};
+
+// an edge's shape in the direction the edge goes, without copying or reversing
+// it. the shape has to outlive the cursor
+class shape_cursor {
+ public:
+  shape_cursor(const std::vector<vm::PointLL> &shape, bool forward) : m_shape(shape), m_forward(forward) {}
+
+  size_t size() const { return m_shape.size(); }
+  const vm::PointLL &operator[](size_t i) const {
+    return m_forward ? m_shape[i] : m_shape[m_shape.size() - 1 - i];
+  }
+
+  // the heading from the point offset meters along the shape towards the point
+  // dist meters further on, or 0 if the shape isn't that long
+  float heading(float offset, float dist) const;
+
+ private:
+  const std::vector<vm::PointLL> &m_shape;
+  bool m_forward;
+};
+
+// remembers the bearings we worked out for the edges we looked at recently.
+// offsets are bucketed to whole meters, which is as precise as a bearing ever
+// was, and entries are kept in small sets which evict their least recently
+// used, so lookups never allocate
+class bearing_cache {
+ public:
+  bearing_cache();
+
+  // the bearing of the edge dist of the way along it
+  uint16_t bearing(const vb::GraphTile *tile, const vb::GraphId &edge_id, float dist);
+
+ private:
+  struct entry {
+    uint64_t edge;
+    uint32_t offset, used;
+    uint16_t bearing;
+  };
+
+  std::vector<entry> m_entries;
+  uint32_t m_clock;
+};
+
+// an open addressed map from edge id to label index which forgets everything
+// it holds in constant time, by bumping a generation instead of clearing slots
+class edge_status {
+ public:
+  static constexpr uint32_t kNotFound = ~0u;
+
+  edge_status();
+  void clear();
+  uint32_t find(uint64_t key) const;
+  void set(uint64_t key, uint32_t value);
+
+ private:
+  size_t slot(uint64_t key) const;
+  void grow();
+
+  uint32_t m_generation, m_size, m_bits;
+  std::vector<uint32_t> m_generations;
+  std::vector<uint64_t> m_keys;
+  std::vector<uint32_t> m_values;
+};
+
+// the costing we route segments with, just the length of edges we could
+// collect traffic on. it is a plain struct rather than a vs::DynamicCost so
+// that the router can inline all of it into its expansion loop
+struct distance_only {
+  bool allowed(const vb::DirectedEdge *edge) const { return check_access(edge); }
+  float cost(const vb::DirectedEdge *edge) const { return edge->length(); }
+  // turns a lower bound on the meters left into a lower bound on the cost left
+  float heuristic(float meters) const { return meters; }
+};
+
+// graph ids only use the low 46 bits so we can mark destination labels in the
+// high ones, that way an edge can be both on the way and at the end of a path
+constexpr uint64_t kDestinationBit = uint64_t(1) << 63;
+constexpr uint32_t kNoPredecessor = ~0u;
+
+// an A* between the candidate edges of two locations which gives up once the
+// path would cost more than some limit. the cost policy is a template argument
+// so nothing in the expansion loop is a virtual call. all of its scratch space
+// is kept between routes, so it only allocates until it has warmed up and
+// resetting it only costs what the last route touched
+template <class cost_policy = distance_only>
+class segment_router {
+ public:
+  explicit segment_router(const cost_policy &cost = cost_policy()) : m_cost(cost), m_max_length(0.0f) {}
+
+  // find the cheapest path from origin to dest that costs at most max_length.
+  // returns false if there isn't one, otherwise the edges of the path are put
+  // in path and what it cost in length
+  bool route(vb::GraphReader &reader, const vb::PathLocation &origin, const vb::PathLocation &dest,
+             float max_length, std::vector<vb::GraphId> &path, float &length);
+
+ private:
+  struct label {
+    vb::GraphId edge;
+    const vb::DirectedEdge *directed_edge;
+    uint32_t predecessor;
+    // cost from the origin to the end of this edge, or to the destination on it
+    float cost;
+    bool settled, destination;
+  };
+
+  void push(const vb::GraphId &edge, const vb::DirectedEdge *directed_edge, uint32_t predecessor,
+            float cost, float heuristic, bool destination);
+  float destination_on(const vb::GraphId &edge) const;
+
+  cost_policy m_cost;
+  std::vector<label> m_labels;
+  // (cost plus heuristic, label index) kept as a min heap
+  std::vector<std::pair<float, uint32_t> > m_queue;
+  edge_status m_status;
+  // the fraction along each destination edge where the destination is
+  std::vector<std::pair<vb::GraphId, float> > m_dest_edges;
+  float m_max_length;
+};
+
+template <class cost_policy>
+bool segment_router<cost_policy>::route(vb::GraphReader &reader, const vb::PathLocation &origin, const vb::PathLocation &dest,
+                                        float max_length, std::vector<vb::GraphId> &path, float &length) {
+  // forget the last route, this only costs as much as it touched
+  m_labels.clear();
+  m_queue.clear();
+  m_status.clear();
+  m_dest_edges.clear();
+  m_max_length = max_length;
+  path.clear();
+
+  // where we are going and how far from the road the location is. the straight
+  // line distance to the location minus that offset never overestimates how
+  // many meters are left to go, so the policy can turn it into a heuristic
+  float offset = 0.0f;
+  for (const auto &edge : dest.edges) {
+    m_dest_edges.emplace_back(edge.id, edge.dist);
+    offset = std::max(offset, edge.projected.Distance(dest.latlng_));
+  }
+  if (m_dest_edges.empty()) {
+    return false;
+  }
+
+  // start from the rest of each origin edge or go straight to the destination
+  // when it is further along that same edge
+  const vb::GraphTile *tile = nullptr;
+  for (const auto &edge : origin.edges) {
+    if (tile == nullptr || tile->id() != edge.id.Tile_Base()) {
+      tile = reader.GetGraphTile(edge.id);
+    }
+    if (tile == nullptr) {
+      continue;
+    }
+    const auto *directed_edge = tile->directededge(edge.id);
+    if (!m_cost.allowed(directed_edge)) {
+      continue;
+    }
+    auto cost = m_cost.cost(directed_edge);
+    auto dest_dist = destination_on(edge.id);
+    if (dest_dist >= edge.dist) {
+      push(edge.id, directed_edge, kNoPredecessor, (dest_dist - edge.dist) * cost, 0.0f, true);
+    }
+    push(edge.id, directed_edge, kNoPredecessor, (1.0f - edge.dist) * cost, 0.0f, false);
+  }
+
+  while (!m_queue.empty()) {
+    std::pop_heap(m_queue.begin(), m_queue.end(), std::greater<std::pair<float, uint32_t> >());
+    auto sort_cost = m_queue.back().first;
+    auto index = m_queue.back().second;
+    m_queue.pop_back();
+
+    // everything left is at least this long so there is nothing within range
+    if (sort_cost > m_max_length) {
+      break;
+    }
+
+    // we may have queued this more than once as we found shorter ways to it
+    if (m_labels[index].settled) {
+      continue;
+    }
+    m_labels[index].settled = true;
+    // copy what we need, pushing below can move the labels around
+    const label current = m_labels[index];
+
+    // done, walk back to the origin to get the path
+    if (current.destination) {
+      length = current.cost;
+      for (auto i = index; i != kNoPredecessor; i = m_labels[i].predecessor) {
+        path.push_back(m_labels[i].edge);
+      }
+      std::reverse(path.begin(), path.end());
+      return true;
+    }
+
+    // expand the node at the end of this edge
+    const auto node_id = current.directed_edge->endnode();
+    if (tile == nullptr || tile->id() != node_id.Tile_Base()) {
+      tile = reader.GetGraphTile(node_id);
+    }
+    if (tile == nullptr) {
+      continue;
+    }
+    const auto *node = tile->node(node_id);
+    const auto remaining = node->latlng().Distance(dest.latlng_) - offset;
+    for (uint32_t i = 0; i < node->edge_count(); ++i) {
+      const auto *directed_edge = tile->directededge(node->edge_index() + i);
+      // no u-turns and only edges we could collect traffic on
+      if (directed_edge->localedgeidx() == current.directed_edge->opp_local_idx() ||
+          !m_cost.allowed(directed_edge)) {
+        continue;
+      }
+      auto edge_id = node_id.Tile_Base() + uint64_t(node->edge_index() + i);
+      auto cost = m_cost.cost(directed_edge);
+      auto dest_dist = destination_on(edge_id);
+      if (dest_dist >= 0.0f) {
+        push(edge_id, directed_edge, index, current.cost + dest_dist * cost, 0.0f, true);
+        continue;
+      }
+      // the end of the edge can be no closer than this to the destination
+      auto heuristic = m_cost.heuristic(std::max(0.0f, remaining - directed_edge->length()));
+      push(edge_id, directed_edge, index, current.cost + cost, heuristic, false);
+    }
+  }
+
+  return false;
+}
+
+template <class cost_policy>
+void segment_router<cost_policy>::push(const vb::GraphId &edge, const vb::DirectedEdge *directed_edge, uint32_t predecessor,
+                                       float cost, float heuristic, bool destination) {
+  // too far to be any use
+  if (cost + heuristic > m_max_length) {
+    return;
+  }
+
+  const uint64_t key = destination ? (edge.value | kDestinationBit) : edge.value;
+  auto index = m_status.find(key);
+  if (index == edge_status::kNotFound) {
+    index = m_labels.size();
+    m_labels.push_back(label{edge, directed_edge, predecessor, cost, false, destination});
+    m_status.set(key, index);
+  }
+  // found a shorter way to something we haven't settled yet
+  else if (!m_labels[index].settled && cost < m_labels[index].cost) {
+    m_labels[index].predecessor = predecessor;
+    m_labels[index].cost = cost;
+  }
+  else {
+    return;
+  }
+
+  m_queue.emplace_back(cost + heuristic, index);
+  std::push_heap(m_queue.begin(), m_queue.end(), std::greater<std::pair<float, uint32_t> >());
+}
+
+template <class cost_policy>
+float segment_router<cost_policy>::destination_on(const vb::GraphId &edge) const {
+  // there are only ever a few of these so a scan is the quickest
+  for (const auto &dest_edge : m_dest_edges) {
+    if (dest_edge.first == edge) {
+      return dest_edge.second;
+    }
+  }
+  return -1.0f;
+}
+
+}
+
+#endif
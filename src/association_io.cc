@@ -0,0 +1,317 @@
+#include "association_io.h"
+
+#include <valhalla/midgard/logging.h>
+#include <valhalla/baldr/graphtile.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+namespace association {
+
+namespace {
+
+enum record_type : uint8_t { kTileDone = 1, kTileFlushed = 2, kCopied = 3, kHashed = 4 };
+
+enum record_flags : uint8_t { kStarts = 1, kEnds = 2 };
+
+uint8_t flags(bool starts, bool ends) {
+  return (starts ? kStarts : 0) | (ends ? kEnds : 0);
+}
+
+uint32_t float_bits(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+float bits_float(uint32_t bits) {
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+template <class T>
+void put_le(std::string& out, T value) {
+  for (size_t i = 0; i < sizeof(T); ++i)
+    out.push_back(char((value >> (i * 8)) & 0xff));
+}
+
+template <class T>
+bool get_le(const char*& pos, const char* end, T& value) {
+  if (end - pos < std::ptrdiff_t(sizeof(T)))
+    return false;
+  value = 0;
+  for (size_t i = 0; i < sizeof(T); ++i)
+    value |= T(uint8_t(pos[i])) << (i * 8);
+  pos += sizeof(T);
+  return true;
+}
+
+void sync_path(const bfs::path& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1 || fsync(fd) != 0) {
+    if (fd != -1)
+      close(fd);
+    throw std::runtime_error("Unable to sync " + path.string());
+  }
+  close(fd);
+}
+
+}
+
+void put_u8(std::string& out, uint8_t value) { put_le(out, value); }
+void put_u32(std::string& out, uint32_t value) { put_le(out, value); }
+void put_u64(std::string& out, uint64_t value) { put_le(out, value); }
+
+bool get_u8(const char*& pos, const char* end, uint8_t& value) { return get_le(pos, end, value); }
+bool get_u32(const char*& pos, const char* end, uint32_t& value) { return get_le(pos, end, value); }
+bool get_u64(const char*& pos, const char* end, uint64_t& value) { return get_le(pos, end, value); }
+
+void put(std::string& out, const leftover& record) {
+  put_u64(out, record.edge.value);
+  put_u64(out, record.segment.value);
+  put_u8(out, flags(record.starts, record.ends));
+}
+
+void put(std::string& out, const partial_chunk& record) {
+  put_u64(out, record.edge.value);
+  put_u64(out, record.segment.value);
+  put_u32(out, float_bits(record.begin));
+  put_u32(out, float_bits(record.end));
+  put_u8(out, flags(record.starts, record.ends));
+}
+
+bool get(const char*& pos, const char* end, leftover& record) {
+  uint64_t edge, segment;
+  uint8_t bits;
+  if (!get_u64(pos, end, edge) || !get_u64(pos, end, segment) || !get_u8(pos, end, bits))
+    return false;
+  record = leftover{vb::GraphId(edge), vb::GraphId(segment), bool(bits & kStarts), bool(bits & kEnds)};
+  return true;
+}
+
+bool get(const char*& pos, const char* end, partial_chunk& record) {
+  uint64_t edge, segment;
+  uint32_t begin, finish;
+  uint8_t bits;
+  if (!get_u64(pos, end, edge) || !get_u64(pos, end, segment) || !get_u32(pos, end, begin) ||
+      !get_u32(pos, end, finish) || !get_u8(pos, end, bits))
+    return false;
+  record = partial_chunk{vb::GraphId(edge), vb::GraphId(segment), bits_float(begin), bits_float(finish),
+                         bool(bits & kStarts), bool(bits & kEnds)};
+  return true;
+}
+
+staging_t::staging_t(const vb::TileHierarchy& hierarchy)
+  : m_hierarchy(hierarchy), m_root(bfs::path(hierarchy.tile_dir()) / kStagingName) {
+}
+
+bool staging_t::stage(const vb::GraphId& tile_id, const std::string& round) const {
+  auto suffix = vb::GraphTile::FileSuffix(tile_id, m_hierarchy);
+  auto live = bfs::path(m_hierarchy.tile_dir()) / suffix;
+  if (!bfs::exists(live))
+    return false;
+  auto staged = m_root / round / suffix;
+  bfs::create_directories(staged.parent_path());
+  bfs::copy_file(live, staged, bfs::copy_option::overwrite_if_exists);
+  return true;
+}
+
+std::string staging_t::directory(const std::string& round) const {
+  return (m_root / round).string();
+}
+
+void staging_t::sync(const vb::GraphId& tile_id, const std::string& round) const {
+  sync_path(m_root / round / vb::GraphTile::FileSuffix(tile_id, m_hierarchy));
+}
+
+bool staging_t::commit(const vb::GraphId& tile_id, const std::string& round) const {
+  auto suffix = vb::GraphTile::FileSuffix(tile_id, m_hierarchy);
+  auto staged = m_root / round / suffix;
+  if (!bfs::exists(staged))
+    return false;
+  auto live = bfs::path(m_hierarchy.tile_dir()) / suffix;
+  bfs::rename(staged, live);
+  sync_path(live.parent_path());
+  return true;
+}
+
+void staging_t::clear() const {
+  bfs::remove_all(m_root);
+}
+
+journal_t::journal_t(const std::string& file_name, bool resume) : copied(false), m_fd(-1), m_done(0) {
+  std::string header;
+  put_u32(header, kJournalMagic);
+  put_u32(header, kJournalVersion);
+
+  //anything shorter than the header never got a record in so it might as well be empty
+  size_t good = 0;
+  if (resume) {
+    std::ifstream in(file_name, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.size() >= header.size()) {
+      if (data.compare(0, header.size(), header) != 0)
+        throw std::runtime_error("The journal " + file_name + " was written by a different version of this tool, "
+                                 "start over without --resume");
+      good = header.size() + read(data.substr(header.size()));
+    }
+    if (good != data.size()) {
+      LOG_WARN("Dropping the last " + std::to_string(data.size() - good) + " bytes of the journal, they are incomplete");
+      if (truncate(file_name.c_str(), good) != 0)
+        throw std::runtime_error("Unable to truncate journal " + file_name);
+    }
+  }
+
+  m_fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_APPEND | (resume ? 0 : O_TRUNC), 0644);
+  if (m_fd == -1)
+    throw std::runtime_error("Unable to open journal " + file_name);
+  if (good == 0)
+    append(header);
+}
+
+journal_t::~journal_t() {
+  close(m_fd);
+}
+
+void journal_t::done(const vb::GraphId& source, const std::vector<vb::GraphId>& targets, const leftovers_t& leftovers,
+                     const partials_t& partials) {
+  std::string record;
+  put_u8(record, kTileDone);
+  put_u64(record, source.value);
+  put_u64(record, targets.size());
+  for (const auto& target : targets)
+    put_u64(record, target.value);
+  put_u64(record, leftovers.size());
+  for (const auto& association : leftovers)
+    put(record, association);
+  put_u64(record, partials.size());
+  for (const auto& chunk : partials)
+    put(record, chunk);
+  std::lock_guard<std::mutex> guard(m_lock);
+  append(record);
+  ++m_done;
+}
+
+void journal_t::flushed(const vb::GraphId& tile_id, uint64_t done_count) {
+  std::string record;
+  put_u8(record, kTileFlushed);
+  put_u64(record, tile_id.value);
+  put_u64(record, done_count);
+  std::lock_guard<std::mutex> guard(m_lock);
+  append(record);
+}
+
+void journal_t::copied_forward() {
+  std::string record;
+  put_u8(record, kCopied);
+  std::lock_guard<std::mutex> guard(m_lock);
+  append(record);
+}
+
+void journal_t::hashed(const vb::GraphId& tile_id, uint64_t hash) {
+  std::string record;
+  put_u8(record, kHashed);
+  put_u64(record, tile_id.value);
+  put_u64(record, hash);
+  std::lock_guard<std::mutex> guard(m_lock);
+  append(record);
+}
+
+void journal_t::append(const std::string& record) {
+  if (write(m_fd, record.data(), record.size()) != ssize_t(record.size()) || fsync(m_fd) != 0)
+    throw std::runtime_error("Unable to write to journal");
+}
+
+// read every complete record, a record cut short by a crash is left for the caller to cut off
+size_t journal_t::read(const std::string& data) {
+  const char* pos = data.data();
+  const char* end = data.data() + data.size();
+  const char* good = pos;
+  uint8_t type;
+  while (get_u8(pos, end, type)) {
+    uint64_t id, count;
+    if (type == kTileDone) {
+      done_t done;
+      if (!get_u64(pos, end, id) || !get_u64(pos, end, count))
+        break;
+      done.source = vb::GraphId(id);
+      for (uint64_t i = 0; i < count && get_u64(pos, end, id); ++i)
+        done.targets.emplace_back(id);
+      if (done.targets.size() != count || !get_u64(pos, end, count))
+        break;
+      leftover association;
+      for (uint64_t i = 0; i < count && get(pos, end, association); ++i)
+        done.leftovers.push_back(association);
+      if (done.leftovers.size() != count || !get_u64(pos, end, count))
+        break;
+      partial_chunk chunk;
+      for (uint64_t i = 0; i < count && get(pos, end, chunk); ++i)
+        done.partials.push_back(chunk);
+      if (done.partials.size() != count)
+        break;
+      finished.emplace_back(std::move(done));
+      ++m_done;
+    }
+    else if (type == kTileFlushed) {
+      if (!get_u64(pos, end, id) || !get_u64(pos, end, count))
+        break;
+      auto& upto = flushed_upto[vb::GraphId(id)];
+      upto = std::max(upto, count);
+    }
+    else if (type == kCopied) {
+      copied = true;
+    }
+    else if (type == kHashed) {
+      uint64_t hash;
+      if (!get_u64(pos, end, id) || !get_u64(pos, end, hash))
+        break;
+      hashes[vb::GraphId(id)] = hash;
+    }
+    else {
+      break;
+    }
+    good = pos;
+  }
+  return good - data.data();
+}
+
+uint64_t spill_key(const leftover& association) {
+  return association.edge.Tile_Base().value;
+}
+
+uint64_t spill_key(const partial_chunk& chunk) {
+  return chunk.edge.Tile_Base().value;
+}
+
+std::string run_header() {
+  std::string header;
+  put_u32(header, kRunMagic);
+  put_u32(header, kRunVersion);
+  return header;
+}
+
+void check_run_header(std::istream& in, const std::string& file_name) {
+  auto expected = run_header();
+  std::string header(expected.size(), '\0');
+  if (!in.read(&header[0], header.size()) || header != expected)
+    throw std::runtime_error("Leftovers in " + file_name + " were not written by this version of this tool");
+}
+
+size_t recover(const journal_t& journal, const staging_t& staging) {
+  size_t committed = 0;
+  for (const auto& finished : journal.finished)
+    committed += staging.commit(finished.source, kLocalRound);
+  for (const auto& flushed : journal.flushed_upto)
+    committed += staging.commit(flushed.first, std::to_string(flushed.second));
+  staging.clear();
+  return committed;
+}
+
+}
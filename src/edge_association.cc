@@ -0,0 +1,770 @@
+#include "edge_association.h"
+
+#include <valhalla/midgard/logging.h>
+#include <valhalla/loki/search.h>
+#include <valhalla/midgard/tiles.h>
+
+#include <cassert>
+#include <cmath>
+#include <ostream>
+#include <limits>
+#include <sstream>
+
+namespace vl = valhalla::loki;
+
+namespace std {
+std::string to_string(const valhalla::midgard::PointLL &p) {
+  std::ostringstream out;
+  out.precision(16);
+  out << "PointLL(" << p.lat() << ", " << p.lng() << ")";
+  return out.str();
+}
+
+std::string to_string(const valhalla::baldr::GraphId &i) {
+  std::ostringstream out;
+  out << "GraphId(" << i.tileid() << ", " << i.level() << ", " << i.id() << ")";
+  return out.str();
+}
+} // namespace std
+
+namespace association {
+
+namespace {
+
+// the distance along a hilbert curve which fills a 2^order by 2^order grid. cells which are
+// close together along the curve are also close together in the grid
+uint64_t hilbert_index(uint32_t x, uint32_t y, uint32_t order) {
+  const uint32_t n = uint32_t(1) << order;
+  uint64_t d = 0;
+  for (uint32_t s = n / 2; s > 0; s /= 2) {
+    uint32_t rx = (x & s) > 0;
+    uint32_t ry = (y & s) > 0;
+    d += uint64_t(s) * s * ((3 * rx) ^ ry);
+    //rotate the quadrant so the curve connects up with the next one
+    if (ry == 0) {
+      if (rx == 1) {
+        x = n - 1 - x;
+        y = n - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
+
+// where a tile is along the hilbert curve over the tiles of its own level
+uint64_t hilbert_key(const vm::Tiles<vm::PointLL>& tiles, uint32_t tileid) {
+  uint32_t columns = tiles.ncolumns();
+  uint32_t order = 0;
+  while ((uint32_t(1) << order) < std::max<uint32_t>(columns, tiles.nrows()))
+    ++order;
+  return hilbert_index(tileid % columns, tileid / columns, order);
+}
+
+
+// how far along the edge, as a fraction of its length, the closest point to pt is
+float fraction_along(const vb::GraphTile *tile, vb::GraphId edge_id, const vm::PointLL &pt) {
+  const auto *edge = tile->directededge(edge_id);
+  auto edgeinfo = tile->edgeinfo(edge->edgeinfo_offset());
+  const auto &shape = edgeinfo.shape();
+
+  // measure along the shape as it is stored and flip it after for reverse edges
+  auto closest = pt.ClosestPoint(shape);
+  size_t index = std::get<2>(closest);
+  double along = 0.0, total = 0.0;
+  for (size_t i = 1; i < shape.size(); ++i) {
+    auto dist = shape[i-1].Distance(shape[i]);
+    if (i <= index) {
+      along += dist;
+    }
+    total += dist;
+  }
+  along += shape[index].Distance(std::get<0>(closest));
+  if (!edge->forward()) {
+    along = total - along;
+  }
+
+  return total > 0.0 ? float(std::max(std::min(along / total, 1.0), 0.0)) : 0.0f;
+}
+
+struct edge_score {
+  vb::GraphId id;
+  int score;
+};
+
+bool is_oneway(const vb::DirectedEdge *e) {
+  // TODO: don't need to find opposite edge, as this info alread in the
+  // reverseaccess mask?
+  return (e->reverseaccess() & vehicular) == 0;
+}
+
+enum class FormOfWay {
+  kUndefined = 0,
+  kMotorway = 1,
+  kMultipleCarriageway = 2,
+  kSingleCarriageway = 3,
+  kRoundabout = 4,
+  kTrafficSquare = 5,
+  kSlipRoad = 6,
+  kOther = 7
+};
+
+std::ostream &operator<<(std::ostream &out, FormOfWay fow) {
+  switch (fow) {
+  case FormOfWay::kUndefined:           out << "undefined";            break;
+  case FormOfWay::kMotorway:            out << "motorway";             break;
+  case FormOfWay::kMultipleCarriageway: out << "multiple_carriageway"; break;
+  case FormOfWay::kSingleCarriageway:   out << "single_carriageway";   break;
+  case FormOfWay::kRoundabout:          out << "roundabout";           break;
+  case FormOfWay::kTrafficSquare:       out << "traffic_square";       break;
+  case FormOfWay::kSlipRoad:            out << "sliproad";             break;
+  default:
+    out << "other";
+  }
+  return out;
+}
+
+FormOfWay form_of_way(const vb::DirectedEdge *e) {
+  bool oneway = is_oneway(e);
+  auto rclass = e->classification();
+
+  // if it's a slip road, return that. TODO: am i doing this right?
+  if (e->link()) {
+    return FormOfWay::kSlipRoad;
+  }
+  // if it's a roundabout, return that
+  else if (e->roundabout()) {
+    return FormOfWay::kRoundabout;
+  }
+  // if it's a motorway and it's one-way, then it's likely to be grade separated
+  else if (rclass == vb::RoadClass::kMotorway && oneway) {
+    return FormOfWay::kMotorway;
+  }
+  // if it's a major road, and it's one-way then it might be a multiple
+  // carriageway road.
+  else if (rclass <= vb::RoadClass::kTertiary && oneway) {
+    return FormOfWay::kMultipleCarriageway;
+  }
+  // not one-way, so perhaps it's a single carriageway
+  else if (rclass <= vb::RoadClass::kTertiary) {
+    return FormOfWay::kSingleCarriageway;
+  }
+  // everything else
+  else {
+    return FormOfWay::kOther;
+  }
+}
+
+vb::PathLocation loki_search_single(const vb::Location &loc, vb::GraphReader &reader, uint8_t level) {
+  auto edge_filter = [level](const vb::DirectedEdge* edge) -> float {
+    return search_filter(edge, level);
+  };
+
+  //we only have one location so we only get one result
+  std::vector<vb::Location> locs{loc};
+  vb::PathLocation path_loc(loc);
+  auto results = vl::Search(locs, reader, edge_filter, vl::PassThroughNodeFilter);
+  if(results.size())
+    path_loc = std::move(results.begin()->second);
+  return path_loc;
+}
+
+vb::GraphId next_edge(const vb::GraphId& edge_id, vb::GraphReader& reader, const vb::GraphTile*& tile) {
+  //walk from this edge to the next one if there is only one choice of where
+  //to walk if there are more choices then just return invalid to signify
+  //stopping this is trying to mimic what osmlr generation does
+  if(tile->id() != edge_id.Tile_Base())
+    tile = reader.GetGraphTile(edge_id);
+  const auto* edge = tile->directededge(edge_id);
+  if(tile->id() != edge->endnode().Tile_Base())
+    tile = reader.GetGraphTile(edge->endnode());
+  const auto* node = tile->node(edge->endnode());
+  const auto* child_edge = tile->directededge(node->edge_index());
+  vb::GraphId next;
+  for(int i = 0; i < node->edge_count(); ++i) {
+    if(!child_edge->trans_up() && child_edge->use() != vb::Use::kTransitConnection &&
+      !child_edge->trans_down() && !child_edge->IsTransitLine())
+    {
+      if(next.Is_Valid())
+        return {};
+      else {
+        next = edge->endnode();
+        next.fields.id = node->edge_index() + i;
+      }
+    }
+  }
+  return next;
+}
+
+std::vector<vb::GraphId> walk(const vb::PathLocation &origin, const vb::PathLocation &dest,
+                              vb::GraphReader& reader, const vb::GraphTile* tile) {
+  //check for the easy case
+  for (const auto &origin_edge : origin.edges)
+    for (const auto &dest_edge : dest.edges)
+      if (origin_edge.id == dest_edge.id)
+        return {origin_edge.id};
+
+  //see if we can easily find a longer path
+  for (const auto &origin_edge : origin.edges) {
+    //try walking from here
+    std::vector<vb::GraphId> edges{origin_edge.id};
+    do {
+      //for each ending edge
+      for (const auto &dest_edge : dest.edges) {
+        //is does this complete the path
+        if (edges.back().id() == dest_edge.id)
+          return edges;
+      }
+      //get the next edge
+      edges.push_back(next_edge(edges.back(), reader, tile));
+      //if the edge is invalid we have no where to go
+    } while(edges.back().Is_Valid());
+  }
+
+  //fail try a route?
+  return {};
+}
+
+// given two bearings in degrees, return the unsigned angle between them.
+int bear_diff(int bear1, int bear2) {
+  int bear_diff = std::abs(bear1 - bear2);
+  if (bear_diff > 180) {
+    bear_diff = 360 - bear_diff;
+  }
+  if (bear_diff < 0) {
+    bear_diff += 360;
+  }
+  return bear_diff;
+}
+
+// given two uint32_t, return the absolute difference between them, which will
+// always fit into another uint32_t.
+uint32_t abs_u32_diff(uint32_t a, uint32_t b) {
+  return (a > b) ? (a - b) : (b - a);
+}
+
+const float kApproxEqualDistanceSquared = 100.0f;
+
+bool approx_equal(const vm::PointLL &a, const vm::PointLL &b) {
+  return a.DistanceSquared(b) <= kApproxEqualDistanceSquared;
+}
+
+} // anonymous namespace
+
+edge_association::edge_association(const bpt::ptree &pt, metrics_t &metrics)
+  : m_reader(pt.get_child("mjolnir"))
+  , m_tile(nullptr)
+  , m_metrics(metrics)
+  , m_search_level(0) {
+}
+
+// neighbouring segments share their end points and a segment needs its last
+// point twice, so rather than asking loki about each one separately we ask it
+// about all the points of the entries we just parsed at once and look them up
+// as we match. a point shared across two windows is just searched again
+void edge_association::search_entries(size_t count, uint8_t level) {
+  m_search_cache.clear();
+  m_search_level = level;
+  auto locs = locations_for_entries(m_entries, count);
+  if (locs.empty())
+    return;
+
+  auto edge_filter = [level](const vb::DirectedEdge* edge) -> float {
+    return search_filter(edge, level);
+  };
+  try {
+    auto results = vl::Search(locs, m_reader, edge_filter, vl::PassThroughNodeFilter);
+    m_search_cache.reserve(results.size());
+    for (auto &result : results)
+      m_search_cache.emplace(result.first, std::move(result.second));
+  }
+  catch (const std::exception &e) {
+    LOG_WARN("Unable to search the entries at once, searching point by point instead: " + std::string(e.what()));
+  }
+}
+
+vb::PathLocation edge_association::search(const vb::Location &loc, uint8_t level) {
+  if (level != m_search_level)
+    return loki_search_single(loc, m_reader, level);
+
+  auto cached = m_search_cache.find(loc);
+  if (cached == m_search_cache.end())
+    cached = m_search_cache.emplace(loc, loki_search_single(loc, m_reader, level)).first;
+  return cached->second;
+}
+
+std::vector<vb::GraphId> edge_association::match_edges(const pbf::Segment &segment, uint8_t level,
+                                                       outcome &result) {
+  const size_t size = segment.lrps_size();
+  assert(size >= 2);
+
+  std::vector<std::vector<edge_score> > locs;
+  locs.resize(size - 1);
+
+  auto origin_coord = coord_for_lrp(segment.lrps(0));
+  auto origin_nodes = m_nodes.within(m_reader, 10.0, origin_coord);
+  if (origin_nodes.size() == 0) {
+    LOG_WARN("Unable to find node near origin " + std::to_string(origin_coord) + ". Segment cannot be matched, discarding.");
+    result = outcome::kNoOriginNode;
+    return std::vector<vb::GraphId>();
+  }
+
+  auto dest_coord = coord_for_lrp(segment.lrps(size - 1));
+  auto dest_nodes = m_nodes.within(m_reader, 10.0, dest_coord);
+  if (dest_nodes.size() == 0) {
+    LOG_WARN("Unable to find node near destination " + std::to_string(dest_coord) + ". Segment cannot be matched, discarding.");
+    result = outcome::kNoDestinationNode;
+    return std::vector<vb::GraphId>();
+  }
+
+  // calculate total length of the segment for comparison to common edges or
+  // short "walked" paths.
+  uint32_t total_length = 0;
+  for (const auto &lrp : segment.lrps()) {
+    total_length += lrp.length();
+  }
+
+  auto common_edge_id = m_common_edges.find(m_reader, origin_nodes, dest_nodes);
+  if (common_edge_id) {
+    // TODO: check bearing, length, FRC, FOW, etc...
+
+    auto *tile = m_reader.GetGraphTile(common_edge_id);
+    auto *edge = tile->directededge(common_edge_id);
+
+    auto &lrp = segment.lrps(0);
+
+    vb::RoadClass road_class = vb::RoadClass(lrp.start_frc());
+    int bear = bear_diff(m_bearings.bearing(tile, common_edge_id, 0.0), lrp.bear());
+    int len = abs_u32_diff(edge->length(), total_length);
+    FormOfWay fow = FormOfWay(lrp.start_fow());
+
+    if ((road_class == edge->classification()) &&
+        (bear < 10) && (len < 10) &&
+        (fow == form_of_way(edge))) {
+
+      // if the edge matches all our expectations, then we can just assume
+      // we found the right edge and return it. this should be significantly
+      // faster than running a whole route to check.
+      std::vector<vb::GraphId> edges;
+      edges.emplace_back(common_edge_id);
+      result = outcome::kCommonEdge;
+      return edges;
+    }
+  }
+
+  auto origin = search(vb::Location(origin_coord), level);
+  origin.edges.erase(std::remove_if(origin.edges.begin(), origin.edges.end(),
+    [](const vb::PathLocation::PathEdge& e){return e.end_node();}), origin.edges.end());
+  auto dest = search(location_for_lrp(segment.lrps(size - 1)), level);
+  dest.edges.erase(std::remove_if(dest.edges.begin(), dest.edges.end(),
+    [](const vb::PathLocation::PathEdge& e){return e.begin_node();}), dest.edges.end());
+
+  // check if its a trivial path between edges
+  auto walked_edges = walk(origin, dest, m_reader, m_tile);
+  if (walked_edges.size()) {
+    // TODO: check bearing, length, FRC, FOW, etc...
+
+    uint32_t walked_length = 0;
+    for (auto edge_id : walked_edges) {
+      auto *tile = m_reader.GetGraphTile(edge_id);
+      auto *edge = tile->directededge(edge_id);
+      walked_length += edge->length();
+    }
+
+    auto *tile = m_reader.GetGraphTile(walked_edges.front());
+    auto *edge = tile->directededge(walked_edges.front());
+
+    auto &lrp = segment.lrps(0);
+
+    vb::RoadClass road_class = vb::RoadClass(lrp.start_frc());
+    int bear = bear_diff(m_bearings.bearing(tile, walked_edges.front(), 0.0), lrp.bear());
+    int len = abs_u32_diff(walked_length, total_length);
+    FormOfWay fow = FormOfWay(lrp.start_fow());
+
+    if ((road_class == edge->classification()) &&
+        (bear < 10) && (len < 10) &&
+        (fow == form_of_way(edge))) {
+
+      // if the edge matches all our expectations, then we can just assume
+      // we found the right edge and return it. this should be significantly
+      // faster than running a whole route to check.
+      // TODO: the first and last match edges could be partial, the TrafficAssociation
+      // must be made aware of this and use the percentages returned in the PathEdge
+      result = outcome::kWalked;
+      return walked_edges;
+    }
+  }
+
+  // check all the interim points of the location reference
+  std::vector<vb::GraphId> edges;
+  for (size_t i = 0; i < size - 1; ++i) {
+    auto &lrp = segment.lrps(i);
+    auto coord = coord_for_lrp(lrp);
+    auto next_coord = coord_for_lrp(segment.lrps(i+1));
+
+    dest = search(location_for_lrp(segment.lrps(i+1)), level);
+    if (dest.edges.size() == 0) {
+      LOG_WARN("Unable to find edge near point " + std::to_string(next_coord) + ". Segment cannot be matched, discarding.");
+      result = outcome::kNoEdgeNearPoint;
+      return std::vector<vb::GraphId>();
+    }
+
+    // score all the edges we could start on at once, only the ones close to the best are worth
+    // routing from. that way a better fitting edge at an intersection wins over a shorter route
+    m_candidates.clear();
+    for (const auto &e : origin.edges) {
+      const auto *tile = m_reader.GetGraphTile(e.id);
+      const auto *edge = tile->directededge(e.id);
+      m_candidates.add(e.projected.Distance(coord), m_bearings.bearing(tile, e.id, e.dist),
+                       float(edge->classification()), float(form_of_way(edge)));
+    }
+    float best = 0.0f;
+    if (origin.edges.size())
+      best = m_candidates.scores[m_candidates.score(lrp)];
+
+    // route from each of the best candidates on its own and keep the route that fits the lrp best,
+    // how far its length is off the lrp's plus the candidate's score. anything much longer than the
+    // lrp says it should be isn't the right path anyway. if none of the best candidates gets us
+    // there the rest get their turn, one at a time and scored the same way
+    auto &path = m_route;
+    auto max_length = lrp.length() * kMaxRouteFactor + kRouteSlack;
+    auto single_origin = origin;
+    bool found = false;
+    int best_score = std::numeric_limits<int>::max();
+    for (int pass = 0; pass < 2 && !found; ++pass) {
+      for (size_t j = 0; j < origin.edges.size(); ++j) {
+        if ((m_candidates.scores[j] > best + kCandidateSlack) != (pass == 1))
+          continue;
+        single_origin.edges.assign(1, origin.edges[j]);
+        float route_length = 0.0f;
+        if (!m_router.route(m_reader, single_origin, dest, max_length, m_candidate_route, route_length))
+          continue;
+        // distance to the lrp, bearing, road class and form of way, which isn't really a metric space...
+        int score = std::abs(int(route_length) - int(lrp.length())) / 10 + int(m_candidates.scores[j]);
+        if (score < best_score) {
+          best_score = score;
+          path.swap(m_candidate_route);
+          found = true;
+        }
+      }
+    }
+    if (!found) {
+      // what to do if there's no path?
+      LOG_WARN("No route to destination " + std::to_string(next_coord) + " from origin point " + std::to_string(coord) + ". Segment cannot be matched, discarding.");
+      result = outcome::kNoRoute;
+      return std::vector<vb::GraphId>();
+    }
+
+    {
+      auto last_edge_id = path.back();
+      auto *tile = m_reader.GetGraphTile(last_edge_id);
+      auto *edge = tile->directededge(last_edge_id);
+      auto node_id = edge->endnode();
+      auto *ntile = (last_edge_id.Tile_Base() == node_id.Tile_Base()) ? tile : m_reader.GetGraphTile(node_id);
+      auto *node = ntile->node(node_id);
+      auto dist = node->latlng().Distance(next_coord);
+      if (dist > 10.0f) {
+        LOG_WARN("Route to destination " + std::to_string(next_coord) + " from origin point " + std::to_string(coord) + " ends more than 10m away: " + std::to_string(node->latlng()) + ". Segment cannot be matched, discarding.");
+        result = outcome::kRouteEndsTooFar;
+        return std::vector<vb::GraphId>();
+      }
+    }
+
+    auto edge_id = path.front();
+    auto *tile = m_reader.GetGraphTile(edge_id);
+    auto *edge = tile->directededge(edge_id);
+
+    if (!check_access(edge)) {
+      LOG_WARN("Edge " + std::to_string(edge_id) + " not accessible. Segment cannot be matched, discarding.");
+      result = outcome::kNotAccessible;
+      return std::vector<vb::GraphId>();
+    }
+
+    auto candidate = std::find_if(origin.edges.begin(), origin.edges.end(),
+      [&edge_id](const vb::PathLocation::PathEdge &e) { return e.id == edge_id; });
+    if (candidate == origin.edges.end()) {
+      LOG_WARN("Unable to find edge " + std::to_string(edge_id) + " at origin point " + std::to_string(origin.latlng_) + ". Segment cannot be matched, discarding.");
+      result = outcome::kNotAtOrigin;
+      return std::vector<vb::GraphId>();
+    }
+
+    edges.insert(edges.end(), path.begin(), path.end());
+
+    // use dest as next origin
+    std::swap(origin, dest);
+  }
+
+  // remove duplicate instances of the edge ID in the path info
+  auto new_end = std::unique(edges.begin(), edges.end());
+  edges.erase(new_end, edges.end());
+
+  result = outcome::kRouted;
+  return edges;
+}
+
+vm::PointLL edge_association::lookup_end_coord(const vb::GraphId& edge_id) {
+  auto *tile = m_reader.GetGraphTile(edge_id);
+  auto *edge = tile->directededge(edge_id);
+  auto node_id = edge->endnode();
+  auto *node_tile = tile;
+  if (edge_id.Tile_Base() != node_id.Tile_Base()) {
+    node_tile = m_reader.GetGraphTile(node_id);
+  }
+  auto *node = node_tile->node(node_id);
+  return node->latlng();
+}
+
+vm::PointLL edge_association::lookup_start_coord(const vb::GraphId& edge_id) {
+  auto *tile = m_reader.GetGraphTile(edge_id);
+  auto *edge = tile->directededge(edge_id);
+  auto opp_index = edge->opp_index();
+  auto node_id = edge->endnode();
+  auto *node_tile = tile;
+  if (edge_id.Tile_Base() != node_id.Tile_Base()) {
+    node_tile = m_reader.GetGraphTile(node_id);
+  }
+  auto *node = node_tile->node(node_id);
+  return lookup_end_coord(node_id.Tile_Base() + uint64_t(node->edge_index() + opp_index));
+}
+
+void edge_association::match_segment(vb::GraphId segment_id, const pbf::Segment &segment) {
+  auto start = steady_clock::now();
+  outcome result;
+  auto edges = match_edges(segment, segment_id.level(), result);
+  m_metrics.matched(segment_id, result, micros_since(start));
+  if (edges.empty()) {
+    LOG_WARN("Unable to match segment " + std::to_string(segment_id) + ".");
+    return;
+  }
+
+  auto seg_start = coord_for_lrp(segment.lrps(0));
+  auto seg_end = coord_for_lrp(segment.lrps(segment.lrps_size() - 1));
+
+  auto edges_start = lookup_start_coord(edges.front());
+  auto edges_end = lookup_end_coord(edges.back());
+
+  if (approx_equal(seg_start, edges_start) &&
+      approx_equal(seg_end, edges_end)) {
+    if (edges.size() == 1) {
+      // if the segment matches to one edge exactly, then we can use it
+      // directly. if not then it requires a level of indirection via
+      // "chunks".
+      assign_one_to_one(edges.front(), segment_id);
+
+    } else {
+      // more than one edge, but matches the segment exactly. this is a
+      // "one to many" case, and can also be looked up directly.
+      assign_one_to_many(edges, segment_id);
+    }
+  } else {
+    // save this for later, when we'll gather up all partial segments
+    // and try to build chunks out of them.
+    save_chunk_for_later(edges, segment_id, seg_start, seg_end);
+  }
+}
+
+// A single traffic segment maps to a single valhalla edge.
+void edge_association::assign_one_to_one(const vb::GraphId& edge_id,
+                                         const vb::GraphId& segment_id) {
+  // Edge starts at the beginning of the traffic segment, ends on the end of
+  // the traffic segment
+  vb::TrafficChunk assoc(segment_id, 0.0f, 1.0f, true, true);
+
+  // Store the local ones, if we are writing them, and leave the non local for later
+  if(m_tile_id == edge_id.Tile_Base()) {
+    if(m_tile_builder)
+      m_tile_builder->AddTrafficSegment(edge_id, assoc);
+  }
+  else
+    m_leftover_associations.push_back(leftover{edge_id, segment_id, true, true});
+}
+
+// A single traffic segment maps to multiple valhalla edges. Each edge is
+// entirely within the segment.
+void edge_association::assign_one_to_many(const std::vector<vb::GraphId> &edges,
+                                          const vb::GraphId& segment_id) {
+  for (size_t i = 0; i < edges.size(); i++) {
+    // Form association for this edge. First edge "starts" the traffic
+    // segment and the last edge ends the segment.
+    const auto& edge_id = edges[i];
+    bool starts = i == 0, ends = i == edges.size() - 1;
+
+    // Store the local segment, if we are writing it, and leave the non local for later
+    if(m_tile_id == edge_id.Tile_Base()) {
+      if(m_tile_builder)
+        m_tile_builder->AddTrafficSegment(edge_id, vb::TrafficChunk(segment_id, 0.0f, 1.0f, starts, ends));
+    }
+    else
+      m_leftover_associations.push_back(leftover{edge_id, segment_id, starts, ends});
+  }
+}
+
+// A single traffic segment maps to multiple valhalla edges, but the first and
+// last edges may only be partially covered by the segment. Work out how much
+// of them is covered and keep the chunks for merging once every thread is done.
+void edge_association::save_chunk_for_later(const std::vector<vb::GraphId> &edges,
+                                            const vb::GraphId& segment_id,
+                                            const vm::PointLL &seg_start,
+                                            const vm::PointLL &seg_end) {
+  for (size_t i = 0; i < edges.size(); i++) {
+    const auto& edge_id = edges[i];
+    partial_chunk chunk{edge_id, segment_id, 0.0f, 1.0f, (i == 0), (i == edges.size() - 1)};
+    if (chunk.starts || chunk.ends) {
+      auto *tile = m_reader.GetGraphTile(edge_id);
+      if (chunk.starts)
+        chunk.begin = fraction_along(tile, edge_id, seg_start);
+      if (chunk.ends)
+        chunk.end = fraction_along(tile, edge_id, seg_end);
+    }
+    if (chunk.end > chunk.begin)
+      m_partial_chunks.emplace_back(chunk);
+  }
+}
+
+leftovers_t edge_association::take_leftovers() {
+  leftovers_t leftovers;
+  leftovers.swap(m_leftover_associations);
+  return leftovers;
+}
+
+partials_t edge_association::take_partials() {
+  partials_t partials;
+  partials.swap(m_partial_chunks);
+  return partials;
+}
+
+bool take_batch(std::vector<work_queue>& queues, size_t self, tile_batch_t& batch) {
+  //try our own queue first
+  {
+    std::lock_guard<std::mutex> guard(queues[self].lock);
+    if(queues[self].batches.size()) {
+      batch = std::move(queues[self].batches.front());
+      queues[self].batches.pop_front();
+      return true;
+    }
+  }
+
+  //steal from someone else, the back of their queue is furthest from what they are working on
+  for(size_t i = 1; i < queues.size(); ++i) {
+    auto& victim = queues[(self + i) % queues.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if(victim.batches.size()) {
+      batch = std::move(victim.batches.back());
+      victim.batches.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+// order the osmlr tiles by area and cut them up into batches so that the tiles in a batch are
+// next to each other and share most of their graph tiles. an area is a tile of the coarsest level,
+// the areas are ordered along a hilbert curve and within each one the highway tile comes first
+// followed by the finer levels underneath it, again along a hilbert curve. matching the highways
+// loads the local tiles around them anyway so the thread that gets the area has them cached by
+// the time it gets to the local segments. otherwise each level is ordered along its own hilbert
+// curve, one level after the other
+std::vector<tile_batch_t> make_batches(const vb::TileHierarchy& hierarchy, std::vector<std::string> file_names,
+  size_t num_threads, bool by_area) {
+
+  size_t batch_size = std::max<size_t>(1, std::min(kMaxTilesPerBatch, file_names.size() / (num_threads * 4)));
+
+  std::vector<std::pair<uint64_t, std::string> > keyed;
+  keyed.reserve(file_names.size());
+  const auto& areas = hierarchy.levels().begin()->second.tiles;
+  const int group_shift = by_area ? 32 : 48;
+  for (auto& file_name : file_names) {
+    auto tile_id = parse_file_name(file_name);
+    uint64_t key = uint64_t(tile_id.level()) << (by_area ? 28 : 48);
+    auto level = hierarchy.levels().find(tile_id.level());
+    if (level != hierarchy.levels().end()) {
+      const auto& tiles = level->second.tiles;
+      if (by_area) {
+        auto bounds = tiles.TileBounds(tile_id.tileid());
+        vm::PointLL center((bounds.minx() + bounds.maxx()) / 2, (bounds.miny() + bounds.maxy()) / 2);
+        key |= hilbert_key(areas, areas.TileId(center)) << 32;
+      }
+      key |= hilbert_key(tiles, tile_id.tileid());
+    }
+    keyed.emplace_back(key, std::move(file_name));
+  }
+  std::sort(keyed.begin(), keyed.end());
+
+  //dont let a batch run over into the next area or level, its tiles wont share much with this one
+  std::vector<tile_batch_t> batches;
+  uint64_t group = std::numeric_limits<uint64_t>::max();
+  for (auto& tile : keyed) {
+    if (batches.empty() || batches.back().size() == batch_size || tile.first >> group_shift != group)
+      batches.emplace_back();
+    group = tile.first >> group_shift;
+    batches.back().emplace_back(std::move(tile.second));
+  }
+  return batches;
+}
+
+void deal_batches(std::vector<tile_batch_t> batches, std::vector<work_queue>& queues) {
+  for (size_t i = 0; i < batches.size(); ++i)
+    queues[i * queues.size() / batches.size()].batches.emplace_back(std::move(batches[i]));
+}
+
+vb::GraphId parse_file_name(const std::string &file_name) {
+  return vb::GraphTile::GetTileId(file_name);
+}
+
+void edge_association::add_tile(const std::string &file_name, bool write_local, const vb::TileHierarchy *write_to) {
+  //map the osmlr tile, entries are parsed a window at a time as we go
+  auto start = steady_clock::now();
+  osmlr_reader tile(file_name);
+
+  //get a tile builder ready for this tile, reading the whole graph tile in again just to throw it
+  //away isnt worth it when nothing will be written
+  auto base_id = parse_file_name(file_name);
+  m_tile_id = base_id;
+  m_tile_builder.reset();
+  if (write_local) {
+    m_tile_builder.reset(new vj::GraphTileBuilder(write_to ? *write_to : m_reader.GetTileHierarchy(), base_id, false));
+    m_tile_builder->InitializeTrafficSegments();
+  }
+  m_tile = m_reader.GetGraphTile(base_id);
+  m_metrics.load.add(micros_since(start));
+
+  //a window of entries at a time, find all the points they need in one go and then match them
+  size_t entry_id = 0;
+  uint64_t search_us = 0, match_us = 0;
+  while (true) {
+    start = steady_clock::now();
+    auto count = tile.next(m_entries, kEntriesPerSearch);
+    if (count == 0)
+      break;
+    search_entries(count, base_id.level());
+    search_us += micros_since(start);
+
+    start = steady_clock::now();
+    for (size_t i = 0; i < count; ++i, ++entry_id) {
+      const auto &entry = m_entries[i];
+      if (!entry.has_marker()) {
+        assert(entry.has_segment());
+        auto &segment = entry.segment();
+        match_segment(base_id + entry_id, segment);
+      }
+    }
+    match_us += micros_since(start);
+  }
+  m_metrics.search.add(search_us);
+  m_metrics.match.add(match_us);
+
+  //finish this tile, keeping the graph tiles around for the neighbouring osmlr tile that this
+  //thread is likely to work on next unless we are using too much memory
+  if (m_reader.OverCommitted()) {
+    m_reader.Clear();
+    m_nodes.clear();
+    ++m_metrics.cache_clears;
+  }
+  if (m_tile_builder) {
+    start = steady_clock::now();
+    m_tile_builder->UpdateTrafficSegments();
+    m_metrics.write.add(micros_since(start));
+  }
+}
+
+}
@@ -0,0 +1,501 @@
+#include "segment_association.h"
+
+#include <valhalla/midgard/distanceapproximator.h>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace association {
+
+vm::PointLL coord_for_lrp(const pbf::Segment::LocationReference &lrp) {
+  int32_t lng = lrp.coord().lng();
+  int32_t lat = lrp.coord().lat();
+  vm::PointLL coord(double(lng) / 10000000, double(lat) / 10000000);
+  return coord;
+}
+
+vb::Location location_for_lrp(const pbf::Segment::LocationReference &lrp) {
+  int32_t lng = lrp.coord().lng();
+  int32_t lat = lrp.coord().lat();
+  vb::Location location({double(lng) / 10000000, double(lat) / 10000000});
+  if(lrp.has_bear())
+    location.heading_ = lrp.bear();
+  return location;
+}
+
+float search_filter(const vb::DirectedEdge* edge, uint8_t level) {
+  //we dont want non real edges but also we want the edges to be on the right level
+  //also right now only driveable edges please
+  return edge->endnode().level() == level && (edge->forwardaccess() & vehicular) &&
+    !(edge->trans_up() || edge->trans_down() || edge->is_shortcut() || edge->IsTransitLine());
+}
+
+// map the whole file read only, entries are only parsed as next gets to them
+osmlr_reader::osmlr_reader(const std::string &file_name)
+  : m_file_name(file_name)
+  , m_data(nullptr)
+  , m_size(0) {
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw std::runtime_error("Unable to open traffic segment file " + file_name);
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    throw std::runtime_error("Unable to stat traffic segment file " + file_name);
+  }
+  m_size = st.st_size;
+  // a stream can only see an int's worth of bytes
+  if (m_size > size_t(std::numeric_limits<int>::max())) {
+    close(fd);
+    throw std::runtime_error("Traffic segment file is too big " + file_name);
+  }
+  if (m_size) {
+    void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("Unable to map traffic segment file " + file_name);
+    }
+    // we only go through it front to back
+    madvise(data, m_size, MADV_SEQUENTIAL);
+    m_data = static_cast<const uint8_t*>(data);
+  }
+  close(fd);
+
+  // by default the stream gives up after 64MB no matter how much it was handed
+  m_in.reset(new google::protobuf::io::CodedInputStream(m_data, int(m_size)));
+#if GOOGLE_PROTOBUF_VERSION >= 3011000
+  m_in->SetTotalBytesLimit(std::numeric_limits<int>::max());
+#else
+  m_in->SetTotalBytesLimit(std::numeric_limits<int>::max(), -1);
+#endif
+}
+
+osmlr_reader::~osmlr_reader() {
+  // the stream points into the mapping so it has to go first
+  m_in.reset();
+  if (m_data) {
+    munmap(const_cast<uint8_t*>(m_data), m_size);
+  }
+}
+
+bool osmlr_reader::next(pbf::Tile::Entry &entry) {
+  using google::protobuf::internal::WireFormatLite;
+
+  auto &in = *m_in;
+  while (uint32_t tag = in.ReadTag()) {
+    if (WireFormatLite::GetTagFieldNumber(tag) == pbf::Tile::kEntriesFieldNumber &&
+        WireFormatLite::GetTagWireType(tag) == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      uint32_t length;
+      if (!in.ReadVarint32(&length)) {
+        break;
+      }
+      auto limit = in.PushLimit(length);
+      entry.Clear();
+      if (!entry.MergeFromCodedStream(&in) || !in.ConsumedEntireMessage()) {
+        break;
+      }
+      in.PopLimit(limit);
+      return true;
+    }
+    // the tile doesn't have anything else in it now, but skip whatever it may get later
+    if (!WireFormatLite::SkipField(&in, tag)) {
+      break;
+    }
+  }
+
+  // a tag of 0 is only how the stream says it ran out, anywhere else the file is broken
+  if (!in.ConsumedEntireMessage() || size_t(in.CurrentPosition()) != m_size) {
+    throw std::runtime_error("Unable to parse traffic segment file " + m_file_name);
+  }
+  return false;
+}
+
+size_t osmlr_reader::next(std::vector<pbf::Tile::Entry> &entries, size_t count) {
+  if (entries.size() < count)
+    entries.resize(count);
+  size_t parsed = 0;
+  while (parsed < count && next(entries[parsed]))
+    ++parsed;
+  return parsed;
+}
+
+// all the locations the first count entries will need searched, each one only once
+std::vector<vb::Location> locations_for_entries(const std::vector<pbf::Tile::Entry> &entries, size_t count) {
+  std::unordered_set<vb::Location> unique;
+  std::vector<vb::Location> locs;
+  auto add = [&unique, &locs](const vb::Location &loc) {
+    if (unique.insert(loc).second)
+      locs.push_back(loc);
+  };
+
+  for (size_t e = 0; e < count; ++e) {
+    const auto &entry = entries[e];
+    if (entry.has_marker() || entry.segment().lrps_size() < 2)
+      continue;
+    //the origin is searched without a heading, everything after it with one
+    const auto &segment = entry.segment();
+    add(vb::Location(coord_for_lrp(segment.lrps(0))));
+    for (int i = 1; i < segment.lrps_size(); ++i)
+      add(location_for_lrp(segment.lrps(i)));
+  }
+  return locs;
+}
+
+vm::AABB2<vm::PointLL> expand_bbox_at_point(float dist, const vm::PointLL &pt) {
+  float meters_per_lng = vm::DistanceApproximator::MetersPerLngDegree(pt.lat());
+  float delta_lng = dist / meters_per_lng;
+  float delta_lat = dist / vm::kMetersPerDegreeLat;
+
+  return vm::AABB2<vm::PointLL>(
+    {pt.lng() - delta_lng, pt.lat() - delta_lat},
+    {pt.lng() + delta_lng, pt.lat() + delta_lat});
+}
+
+node_index::node_index(const vb::GraphTile *tile, const vm::AABB2<vm::PointLL> &bounds)
+  : m_tile_id(tile->id())
+  , m_minx(bounds.minx())
+  , m_miny(bounds.miny()) {
+  // aim for a few nodes per cell
+  const uint32_t count = tile->header()->nodecount();
+  m_size = std::max(1u, std::min(256u, uint32_t(std::sqrt(count / 4.0))));
+  m_cell_width = (bounds.maxx() - bounds.minx()) / m_size;
+  m_cell_height = (bounds.maxy() - bounds.miny()) / m_size;
+
+  // count the nodes in each cell and turn that into where each cell starts
+  std::vector<uint32_t> node_cells(count);
+  m_cells.assign(m_size * m_size + 1, 0);
+  for (uint32_t i = 0; i < count; ++i) {
+    auto ll = tile->node(i)->latlng();
+    node_cells[i] = cell(ll.lng(), ll.lat());
+    ++m_cells[node_cells[i] + 1];
+  }
+  for (size_t i = 1; i < m_cells.size(); ++i) {
+    m_cells[i] += m_cells[i - 1];
+  }
+
+  // then put each node in its place
+  m_lngs.resize(count);
+  m_lats.resize(count);
+  m_ids.resize(count);
+  m_edge_indices.resize(count);
+  m_edge_counts.resize(count);
+  std::vector<uint32_t> next(m_cells.begin(), m_cells.end() - 1);
+  for (uint32_t i = 0; i < count; ++i) {
+    const auto *node = tile->node(i);
+    auto pos = next[node_cells[i]]++;
+    m_lngs[pos] = node->latlng().lng();
+    m_lats[pos] = node->latlng().lat();
+    m_ids[pos] = i;
+    m_edge_indices[pos] = node->edge_index();
+    m_edge_counts[pos] = node->edge_count();
+  }
+}
+
+uint32_t node_index::cell(float x, float y) const {
+  int32_t column = std::min(std::max(int32_t((x - m_minx) / m_cell_width), 0), int32_t(m_size) - 1);
+  int32_t row = std::min(std::max(int32_t((y - m_miny) / m_cell_height), 0), int32_t(m_size) - 1);
+  return row * m_size + column;
+}
+
+void node_index::within(const vm::PointLL &pt, float dist, std::vector<node_ref> &nodes) const {
+  if (m_size == 0) {
+    return;
+  }
+
+  // the cells the query circle overlaps
+  const float meters_per_lng = vm::DistanceApproximator::MetersPerLngDegree(pt.lat());
+  const float meters_per_lat = vm::kMetersPerDegreeLat;
+  const float delta_lng = dist / meters_per_lng;
+  const float delta_lat = dist / meters_per_lat;
+  if (pt.lng() + delta_lng < m_minx || pt.lng() - delta_lng > m_minx + m_cell_width * m_size ||
+      pt.lat() + delta_lat < m_miny || pt.lat() - delta_lat > m_miny + m_cell_height * m_size) {
+    return;
+  }
+  const auto lower = cell(pt.lng() - delta_lng, pt.lat() - delta_lat);
+  const auto upper = cell(pt.lng() + delta_lng, pt.lat() + delta_lat);
+
+  // the cells in a row are next to each other in the arrays so we can filter a whole row span
+  // at once, the distance is the usual equirectangular approximation
+  const float max_dist_sq = dist * dist;
+  for (uint32_t row = lower / m_size; row <= upper / m_size; ++row) {
+    const uint32_t begin = m_cells[row * m_size + lower % m_size];
+    const uint32_t end = m_cells[row * m_size + upper % m_size + 1];
+    for (uint32_t i = begin; i < end; ++i) {
+      const float dx = (m_lngs[i] - pt.lng()) * meters_per_lng;
+      const float dy = (m_lats[i] - pt.lat()) * meters_per_lat;
+      if (dx * dx + dy * dy <= max_dist_sq) {
+        vb::GraphId id = m_tile_id;
+        id.fields.id = m_ids[i];
+        nodes.push_back({id, m_edge_indices[i], m_edge_counts[i]});
+      }
+    }
+  }
+}
+
+std::vector<node_ref> node_finder::within(vb::GraphReader &reader, float dist, const vm::PointLL &pt) {
+  std::vector<node_ref> nodes;
+  const auto bbox = expand_bbox_at_point(dist, pt);
+  for (const auto &level : reader.GetTileHierarchy().levels()) {
+    for (auto tile_id : level.second.tiles.TileList(bbox)) {
+      index_for(reader, vb::GraphId(tile_id, level.first, 0)).within(pt, dist, nodes);
+    }
+  }
+  return nodes;
+}
+
+void node_finder::clear() {
+  m_indices.clear();
+}
+
+const node_index& node_finder::index_for(vb::GraphReader &reader, const vb::GraphId &tile_id) {
+  // build it the first time we look in a tile, tiles which don't exist get an empty one
+  auto found = m_indices.find(tile_id);
+  if (found == m_indices.end()) {
+    const auto *tile = reader.GetGraphTile(tile_id);
+    if (tile == nullptr) {
+      found = m_indices.emplace(tile_id, node_index()).first;
+    } else {
+      const auto &tiles = reader.GetTileHierarchy().levels().find(tile_id.level())->second.tiles;
+      found = m_indices.emplace(tile_id, node_index(tile, tiles.TileBounds(tile_id.tileid()))).first;
+    }
+  }
+  return found->second;
+}
+
+vb::GraphId common_edge_finder::find(vb::GraphReader &reader, const std::vector<node_ref> &origins,
+                                     const std::vector<node_ref> &dests) {
+  // every edge leaving an origin, sorted so we can binary search it. there are
+  // only ever a handful of them so this beats hashing
+  m_start_edges.clear();
+  for (const auto &node : origins) {
+    const auto base = node.id.Tile_Base();
+    for (uint32_t i = 0; i < node.edge_count; ++i) {
+      m_start_edges.push_back(base + uint64_t(node.edge_index + i));
+    }
+  }
+
+  if (m_start_edges.empty()) {
+    return vb::GraphId();
+  }
+  std::sort(m_start_edges.begin(), m_start_edges.end(),
+            [](const vb::GraphId &a, const vb::GraphId &b) { return a.value < b.value; });
+
+  // every edge leaving a destination, grouped by the tile its end node is in so
+  // that we only get each of those tiles once when finding the opposing edges
+  m_dest_edges.clear();
+  const vb::GraphTile *tile = nullptr;
+  for (const auto &node : dests) {
+    if (tile == nullptr || tile->id() != node.id.Tile_Base()) {
+      tile = reader.GetGraphTile(node.id);
+    }
+    for (uint32_t i = 0; i < node.edge_count; ++i) {
+      const auto *edge = tile->directededge(node.edge_index + i);
+      m_dest_edges.emplace_back(edge->endnode().Tile_Base(), edge);
+    }
+  }
+  std::sort(m_dest_edges.begin(), m_dest_edges.end(),
+            [](const std::pair<vb::GraphId, const vb::DirectedEdge*> &a,
+               const std::pair<vb::GraphId, const vb::DirectedEdge*> &b) {
+              return a.first.value < b.first.value;
+            });
+
+  vb::GraphId found;
+  const vb::GraphTile *opp_tile = nullptr;
+  for (const auto &dest_edge : m_dest_edges) {
+    if (opp_tile == nullptr || opp_tile->id() != dest_edge.first) {
+      opp_tile = reader.GetGraphTile(dest_edge.first);
+    }
+    auto opp_id = opp_tile->GetOpposingEdgeId(dest_edge.second);
+
+    if (std::binary_search(m_start_edges.begin(), m_start_edges.end(), opp_id,
+                           [](const vb::GraphId &a, const vb::GraphId &b) { return a.value < b.value; })) {
+      if (found) {
+        // already found a candidate, and can't have two candidates.
+        return vb::GraphId();
+      } else {
+        found = opp_id;
+      }
+    }
+  }
+
+  return found;
+}
+
+float shape_cursor::heading(float offset, float dist) const {
+  const size_t n = size();
+  if (n < 2) {
+    return 0.0f;
+  }
+
+  // find the point offset meters along
+  auto start = (*this)[0];
+  size_t i = 1;
+  if (offset > 0.0f) {
+    double d = 0.0;
+    for (; i < n; ++i) {
+      auto segdist = (*this)[i - 1].Distance((*this)[i]);
+      if (d + segdist >= offset) {
+        double frac = segdist > 0.0 ? (offset - d) / segdist : 0.0;
+        start = (*this)[i - 1].AffineCombination(1.0 - frac, frac, (*this)[i]);
+        break;
+      }
+      d += segdist;
+    }
+    // ran off the end
+    if (i == n) {
+      return 0.0f;
+    }
+  }
+
+  // then head towards the point dist further on, or the end if that's closer
+  double d = 0.0;
+  auto previous = start;
+  for (; i < n; ++i) {
+    auto segdist = previous.Distance((*this)[i]);
+    if (d + segdist > dist) {
+      double frac = (dist - d) / segdist;
+      return start.Heading(previous.AffineCombination(1.0 - frac, frac, (*this)[i]));
+    }
+    d += segdist;
+    previous = (*this)[i];
+  }
+  return start.Heading((*this)[n - 1]);
+}
+
+namespace {
+
+constexpr size_t kBearingSets = 1024;
+constexpr size_t kBearingWays = 4;
+
+}
+
+bearing_cache::bearing_cache()
+  : m_entries(kBearingSets * kBearingWays, entry{~uint64_t(0), 0, 0, 0})
+  , m_clock(0) {
+}
+
+uint16_t bearing_cache::bearing(const vb::GraphTile *tile, const vb::GraphId &edge_id, float dist) {
+  const auto *edge = tile->directededge(edge_id);
+  const uint32_t offset = dist > 0.0f ? uint32_t(dist * edge->length()) : 0;
+
+  // look in the set this would be in, remembering which one was used longest ago
+  const uint64_t hash = (edge_id.value ^ (uint64_t(offset) << 46)) * 0x9E3779B97F4A7C15ull;
+  auto *set = &m_entries[(hash >> 54) % kBearingSets * kBearingWays];
+  auto *oldest = set;
+  ++m_clock;
+  for (auto *way = set; way != set + kBearingWays; ++way) {
+    if (way->edge == edge_id.value && way->offset == offset) {
+      way->used = m_clock;
+      return way->bearing;
+    }
+    if (way->used < oldest->used) {
+      oldest = way;
+    }
+  }
+
+  // OpenLR says to use 20m along the edge, but we could use the
+  // GetOffsetForHeading function, which adapts it to the road class.
+  auto edgeinfo = tile->edgeinfo(edge->edgeinfo_offset());
+  shape_cursor shape(edgeinfo.shape(), edge->forward());
+  float heading = shape.heading(offset, 20);
+  assert(heading >= 0.0);
+  assert(heading < 360.0);
+
+  *oldest = entry{edge_id.value, offset, m_clock, uint16_t(std::round(heading))};
+  return oldest->bearing;
+}
+
+constexpr uint32_t edge_status::kNotFound;
+
+edge_status::edge_status()
+  : m_generation(1)
+  , m_size(0)
+  , m_bits(10)
+  , m_generations(size_t(1) << m_bits, 0)
+  , m_keys(size_t(1) << m_bits)
+  , m_values(size_t(1) << m_bits) {
+}
+
+void edge_status::clear() {
+  // only when the generation wraps do we actually have to touch every slot
+  m_size = 0;
+  if (++m_generation == 0) {
+    std::fill(m_generations.begin(), m_generations.end(), 0);
+    m_generation = 1;
+  }
+}
+
+size_t edge_status::slot(uint64_t key) const {
+  // fibonacci hashing, the high bits of the product are the well mixed ones
+  return (key * 0x9E3779B97F4A7C15ull) >> (64 - m_bits);
+}
+
+uint32_t edge_status::find(uint64_t key) const {
+  const size_t mask = m_keys.size() - 1;
+  for (size_t i = slot(key); m_generations[i] == m_generation; i = (i + 1) & mask) {
+    if (m_keys[i] == key) {
+      return m_values[i];
+    }
+  }
+  return kNotFound;
+}
+
+void edge_status::set(uint64_t key, uint32_t value) {
+  // keep it at most half full so probes stay short
+  if ((m_size + 1) * 2 > m_keys.size()) {
+    grow();
+  }
+
+  const size_t mask = m_keys.size() - 1;
+  size_t i = slot(key);
+  for (; m_generations[i] == m_generation; i = (i + 1) & mask) {
+    if (m_keys[i] == key) {
+      m_values[i] = value;
+      return;
+    }
+  }
+  m_generations[i] = m_generation;
+  m_keys[i] = key;
+  m_values[i] = value;
+  ++m_size;
+}
+
+void edge_status::grow() {
+  std::vector<uint32_t> generations(m_generations.size() * 2, 0);
+  std::vector<uint64_t> keys(m_keys.size() * 2);
+  std::vector<uint32_t> values(m_values.size() * 2);
+  std::swap(generations, m_generations);
+  std::swap(keys, m_keys);
+  std::swap(values, m_values);
+  ++m_bits;
+
+  // put whatever is live back in, nothing else survives the move
+  const size_t mask = m_keys.size() - 1;
+  for (size_t j = 0; j < keys.size(); ++j) {
+    if (generations[j] != m_generation) {
+      continue;
+    }
+    size_t i = slot(keys[j]);
+    while (m_generations[i] == m_generation) {
+      i = (i + 1) & mask;
+    }
+    m_generations[i] = m_generation;
+    m_keys[i] = keys[j];
+    m_values[i] = values[j];
+  }
+}
+
+}
@@ -2,9 +2,6 @@
 #include <valhalla/baldr/graphreader.h>
 #include <valhalla/baldr/merge.h>
 #include <valhalla/loki/search.h>
-#include <valhalla/loki/node_search.h>
-#include <valhalla/thor/pathalgorithm.h>
-#include <valhalla/thor/astar.h>
 #include <valhalla/mjolnir/graphtilebuilder.h>
 
 #include <boost/program_options.hpp>
@@ -16,20 +13,26 @@
 #include <boost/iterator/reverse_iterator.hpp>
 
 #include <deque>
+#include <limits>
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
 #include <thread>
 #include <mutex>
-#include <future>
+#include <condition_variable>
+#include <fstream>
 
 #include "config.h"
 #include "segment.pb.h"
 #include "tile.pb.h"
+#include "segment_association.h"
+#include "edge_association.h"
+#include "association_io.h"
 
 namespace vm = valhalla::midgard;
 namespace vb = valhalla::baldr;
 namespace vl = valhalla::loki;
-namespace vs = valhalla::sif;
-namespace vt = valhalla::thor;
 namespace vj = valhalla::mjolnir;
 namespace pbf = opentraffic::osmlr;
 
@@ -38,881 +41,660 @@ namespace bpo = boost::program_options;
 namespace bpt = boost::property_tree;
 namespace bfs = boost::filesystem;
 
-namespace std {
-std::string to_string(const vm::PointLL &p) {
-  std::ostringstream out;
-  out.precision(16);
-  out << "PointLL(" << p.lat() << ", " << p.lng() << ")";
-  return out.str();
-}
-
-std::string to_string(const vb::GraphId &i) {
-  std::ostringstream out;
-  out << "GraphId(" << i.tileid() << ", " << i.level() << ", " << i.id() << ")";
-  return out.str();
-}
-} // namespace std
-
 namespace {
 
-// be permissive here, as we do want to collect traffic on most vehicular
-// routes.
-constexpr uint32_t vehicular = vb::kAutoAccess | vb::kTruckAccess |
-    vb::kTaxiAccess | vb::kBusAccess | vb::kHOVAccess;
-
-vm::PointLL interp(vm::PointLL a, vm::PointLL b, double frac) {
-  return vm::PointLL(a.AffineCombination(1.0 - frac, frac, b));
-}
-
-// chop the first "dist" length off seg, returning it as the result. this will
-// modify seg!
-std::vector<vm::PointLL> chop_subsegment(std::vector<vm::PointLL> &seg, uint32_t dist) {
-  const size_t len = seg.size();
-  assert(len > 1);
-
-  std::vector<vm::PointLL> result;
-  result.push_back(seg[0]);
-  double d = 0.0;
-  size_t i = 1;
-  for (; i < len; ++i) {
-    auto segdist = seg[i-1].Distance(seg[i]);
-    if ((d + segdist) >= dist) {
-      double frac = (dist - d) / segdist;
-      auto midpoint = interp(seg[i-1], seg[i], frac);
-      result.push_back(midpoint);
-      // remove used part of seg.
-      seg.erase(seg.begin(), seg.begin() + (i - 1));
-      seg[0] = midpoint;
+using association::edge_association;
+using association::metrics_t;
+using association::outcome_names;
+using association::leftover;
+using association::partial_chunk;
+using association::leftovers_t;
+using association::partials_t;
+using association::staging_t;
+using association::journal_t;
+using association::kLocalRound;
+using association::run_writer;
+using association::run_merger;
+using association::steady_clock;
+using association::micros_since;
+using association::parse_file_name;
+using association::tile_batch_t;
+using association::work_queue;
+using association::take_batch;
+
+// the graph reader's own default cache size, which we split up between the threads
+constexpr size_t kDefaultMaxCacheSize = 1073741824;
+
+// traffic chunks only keep whole percents of an edge
+int percent(float fraction) {
+  return int(std::round(fraction * 100.0f));
+}
+
+// what is left of [begin, end) once whatever is already covered is taken out of it. covered is
+// kept sorted and without overlaps and the range is added to it
+std::vector<std::pair<int, int> > uncovered(std::vector<std::pair<int, int> >& covered, int begin, int end) {
+  std::vector<std::pair<int, int> > pieces;
+  int at = begin;
+  for (const auto& range : covered) {
+    if (range.second <= at)
+      continue;
+    if (range.first >= end)
       break;
-
-    } else {
-      d += segdist;
-      result.push_back(seg[i]);
+    if (range.first > at)
+      pieces.emplace_back(at, range.first);
+    at = std::max(at, range.second);
+  }
+  if (at < end)
+    pieces.emplace_back(at, end);
+
+  auto position = std::upper_bound(covered.begin(), covered.end(), std::make_pair(begin, end));
+  covered.emplace(position, begin, end);
+  size_t merged = 0;
+  for (size_t i = 1; i < covered.size(); ++i) {
+    if (covered[i].first <= covered[merged].second)
+      covered[merged].second = std::max(covered[merged].second, covered[i].second);
+    else
+      covered[++merged] = covered[i];
+  }
+  covered.resize(merged + 1);
+  return pieces;
+}
+
+// several threads may have covered parts of the same edge with different segments, and some of
+// the edge may already be covered, by what was written to the tile before, in an earlier round say,
+// or by a whole edge association going into the tile along with these. put the chunks of each edge
+// in order along it and cut out anything already covered so that no part of an edge is covered
+// twice. it all comes down to whole percents in the end so anything that rounds away to nothing
+// is dropped
+partials_t merge_partials(partials_t &partials, const leftovers_t &whole, const vb::GraphTile &tile) {
+  std::sort(partials.begin(), partials.end(), [](const partial_chunk &a, const partial_chunk &b) {
+    return a.edge == b.edge ? a.begin < b.begin : a.edge.value < b.edge.value;
+  });
+  std::unordered_set<vb::GraphId> whole_edges;
+  for (const auto &association : whole)
+    whole_edges.insert(association.edge);
+
+  partials_t associations;
+  vb::GraphId edge;
+  std::vector<std::pair<int, int> > covered;
+  for (const auto &chunk : partials) {
+    if (chunk.edge != edge) {
+      edge = chunk.edge;
+      covered.clear();
+      if (whole_edges.count(edge))
+        covered.emplace_back(0, 100);
+      for (const auto &segment : tile.GetTrafficSegments(edge))
+        uncovered(covered, percent(segment.begin_percent_), percent(segment.end_percent_));
     }
+    int begin = percent(chunk.begin), end = percent(chunk.end);
+    for (const auto &piece : uncovered(covered, begin, end))
+      associations.push_back(partial_chunk{chunk.edge, chunk.segment, piece.first / 100.0f, piece.second / 100.0f,
+        chunk.starts && piece.first == begin, chunk.ends && piece.second == end});
   }
-
-  // used all of seg, and exited the loop by iteration rather than breaking out.
-  if (i == len) {
-    seg.clear();
-  }
-
-  return result;
+  return associations;
 }
 
-uint16_t bearing(const std::vector<vm::PointLL> &shape) {
-  // OpenLR says to use 20m along the edge, but we could use the
-  // GetOffsetForHeading function, which adapts it to the road class.
-  float heading = vm::PointLL::HeadingAlongPolyline(shape, 20);
-  assert(heading >= 0.0);
-  assert(heading < 360.0);
-  return uint16_t(std::round(heading));
-}
-
-uint16_t bearing(const vb::GraphTile *tile, vb::GraphId edge_id, float dist) {
-  std::vector<vm::PointLL> shape;
-  const auto *edge = tile->directededge(edge_id);
-  uint32_t edgeinfo_offset = edge->edgeinfo_offset();
-  auto edgeinfo = tile->edgeinfo(edgeinfo_offset);
-  uint32_t edge_len = edge->length();
-
-  shape = edgeinfo.shape();
-  if (!edge->forward()) {
-    std::reverse(shape.begin(), shape.end());
-  }
-
-  if (dist > 0.0) {
-    chop_subsegment(shape, uint32_t(dist * edge_len));
-  }
-
-  return bearing(shape);
-}
-
-struct partial_chunk {
-  std::vector<vb::GraphId> edges, segments;
-};
-
-using leftovers_t = std::vector<std::pair<GraphId, vb::TrafficChunk > >;
-struct edge_association {
-  explicit edge_association(const bpt::ptree &pt);
-
-  void add_tile(const std::string &file_name);
-  const leftovers_t& leftovers() const { return m_leftover_associations; }
-
-private:
-  void match_segment(vb::GraphId segment_id, const pbf::Segment &segment);
-  std::vector<vb::GraphId> match_edges(const pbf::Segment &segment, uint8_t level);
-  vm::PointLL lookup_end_coord(const vb::GraphId& edge_id);
-  vm::PointLL lookup_start_coord(const vb::GraphId& edge_id);
-  std::vector<vb::GraphId> find_nodes_within(float dist, const vm::PointLL &pt);
-  vb::GraphId find_common_edge(const std::vector<vb::GraphId> &origins,
-                               const std::vector<vb::GraphId> &dests);
-
-  void assign_one_to_one(const vb::GraphId& edge_id, const vb::GraphId& segment_id);
-  void assign_one_to_many(const std::vector<vb::GraphId> &edges, const vb::GraphId& segment_id);
-  void save_chunk_for_later(const std::vector<vb::GraphId> &edges, vb::GraphId segment_id);
-
-  vb::GraphReader m_reader;
-  vs::TravelMode m_travel_mode;
-  std::shared_ptr<vt::PathAlgorithm> m_path_algo;
-  std::shared_ptr<vs::DynamicCost> m_costing;
-  std::shared_ptr<vj::GraphTileBuilder> m_tile_builder;
-  const vb::GraphTile* m_tile;
-  // chunks saved for later
-  std::list<partial_chunk> m_partial_chunks;
-  // simple associations saved for later
-  leftovers_t m_leftover_associations;
-};
-
-struct edge_score {
-  vb::GraphId id;
-  int score;
+// everything that still has to be written to a tile once the local associations are done
+struct tile_leftovers {
+  leftovers_t associations;
+  partials_t partials;
 };
 
-bool edge_pred(const vb::DirectedEdge *edge) {
-  return (edge->use() != vb::Use::kFerry &&
-          edge->use() != vb::Use::kTransitConnection &&
-          !edge->trans_up() &&
-          !edge->trans_down());
-}
-
-bool check_access(const vb::DirectedEdge *edge) {
-  uint32_t access = vb::kAllAccess;
-  access &= edge->forwardaccess();
-
-  // if any edge is a shortcut, then drop the whole path
-  if (edge->is_shortcut()) {
-    return false;
-  }
-
-  // if the edge predicate is false for any edge, then drop the whole
-  // path.
-  if (edge_pred(edge) == false) {
-    return false;
-  }
-
-  return access & vehicular;
-}
-
-bool is_oneway(const vb::DirectedEdge *e) {
-  // TODO: don't need to find opposite edge, as this info alread in the
-  // reverseaccess mask?
-  return (e->reverseaccess() & vehicular) == 0;
-}
+// the tile and the 8 tiles around it on the same level, wrapping around the antimeridian
+std::vector<vb::GraphId> neighbourhood(const vb::TileHierarchy& hierarchy, const vb::GraphId& tile_id) {
+  auto level = hierarchy.levels().find(tile_id.level());
+  if (level == hierarchy.levels().end())
+    return {tile_id.Tile_Base()};
+
+  const auto& tiles = level->second.tiles;
+  int32_t columns = tiles.ncolumns(), rows = tiles.nrows();
+  int32_t column = tile_id.tileid() % columns, row = tile_id.tileid() / columns;
+  std::vector<vb::GraphId> neighbours;
+  for (int32_t r = std::max(row - 1, 0); r <= std::min(row + 1, rows - 1); ++r)
+    for (int32_t c = column - 1; c <= column + 1; ++c)
+      neighbours.emplace_back(r * columns + (c + columns) % columns, tile_id.level(), 0);
+  return neighbours;
+}
+
+// leftovers are kept per destination tile and handed to a writer as soon as every osmlr tile
+// which could produce some for it is done. segments are short so those are the osmlr tiles in
+// the 3x3 block around the destination, including its own which writes the local associations.
+// should a segment reach further than that, its leftovers are just written in another round
+class leftover_queue {
+ public:
+  leftover_queue(const vb::TileHierarchy& hierarchy, const std::vector<vb::GraphId>& sources,
+                 journal_t* journal = nullptr, const staging_t* staging = nullptr)
+    : m_hierarchy(hierarchy), m_journal(journal), m_staging(staging), m_closed(false) {
+    for (const auto& source : sources)
+      for (const auto& neighbour : neighbourhood(m_hierarchy, source))
+        ++m_tiles[neighbour].producers;
+  }
+
+  // an osmlr tile is done, journal it and queue up what it left over for other tiles. its local
+  // associations go into its graph tile before anyone can write leftovers to it
+  void finished(const vb::GraphId& source, const std::vector<vb::GraphId>& targets, leftovers_t leftovers,
+                partials_t partials) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    if (m_journal)
+      m_journal->done(source, targets, leftovers, partials);
+    if (m_staging)
+      m_staging->commit(source, kLocalRound);
+    queue_up(source, std::move(leftovers), std::move(partials));
+  }
+
+  // an osmlr tile was done by a run we are resuming, queue up what it left that isnt written yet
+  void replay(const vb::GraphId& source, leftovers_t leftovers, partials_t partials) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    queue_up(source, std::move(leftovers), std::move(partials));
+  }
+
+  // all the osmlr tiles are done, so whatever is left can be written
+  void close() {
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_closed = true;
+    for (auto& tile : m_tiles)
+      tile.second.producers = 0;
+    for (const auto& tile : m_tiles)
+      ready(tile.first);
+    m_ready_cv.notify_all();
+  }
+
+  // blocks until there is a tile to write, returns false once everything is written. the round
+  // is where the tile should be staged for writing
+  bool pop(vb::GraphId& tile_id, tile_leftovers& leftovers, std::string& round) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_ready_cv.wait(lock, [this]() { return m_ready.size() || m_closed; });
+    if (m_ready.empty())
+      return false;
+
+    tile_id = m_ready.front();
+    m_ready.pop_front();
+    auto& tile = m_tiles[tile_id];
+    tile.queued = false;
+    tile.writing = true;
+    tile.popped_at = m_journal ? m_journal->done_count() : 0;
+    round = std::to_string(tile.popped_at);
+    leftovers = std::move(tile.pending);
+    tile.pending = tile_leftovers();
+    return true;
+  }
+
+  // the writer is done with this tile, more may have come in for it in the mean time though. the
+  // next round starts from the real tile so this round has to be committed before that can happen
+  void written(const vb::GraphId& tile_id) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    auto tile = m_tiles.find(tile_id);
+    tile->second.writing = false;
+    if (m_journal)
+      m_journal->flushed(tile_id, tile->second.popped_at);
+    if (m_staging)
+      m_staging->commit(tile_id, std::to_string(tile->second.popped_at));
+    if (!ready(tile_id) && tile->second.producers == 0)
+      m_tiles.erase(tile);
+  }
+
+ private:
+  struct tile_state {
+    tile_state() : producers(0), queued(false), writing(false), popped_at(0) {}
+    int32_t producers;
+    bool queued, writing;
+    // how many osmlr tiles were done when the writer took what was pending
+    uint64_t popped_at;
+    tile_leftovers pending;
+  };
 
-enum class FormOfWay {
-  kUndefined = 0,
-  kMotorway = 1,
-  kMultipleCarriageway = 2,
-  kSingleCarriageway = 3,
-  kRoundabout = 4,
-  kTrafficSquare = 5,
-  kSlipRoad = 6,
-  kOther = 7
+  // queue the tile up for writing if there is something to write and nobody else can touch it
+  bool ready(const vb::GraphId& tile_id) {
+    auto& tile = m_tiles[tile_id];
+    if (tile.queued)
+      return true;
+    if (tile.producers > 0 || tile.writing ||
+        (tile.pending.associations.empty() && tile.pending.partials.empty()))
+      return false;
+    tile.queued = true;
+    m_ready.push_back(tile_id);
+    m_ready_cv.notify_one();
+    return true;
+  }
+
+  // hand what a tile left over to the tiles it belongs to and wake up writers for anything now complete
+  void queue_up(const vb::GraphId& source, leftovers_t leftovers, partials_t partials) {
+    std::unordered_set<vb::GraphId> touched;
+    for (auto& association : leftovers) {
+      auto tile_id = association.edge.Tile_Base();
+      m_tiles[tile_id].pending.associations.emplace_back(std::move(association));
+      touched.insert(tile_id);
+    }
+    for (auto& chunk : partials) {
+      auto tile_id = chunk.edge.Tile_Base();
+      m_tiles[tile_id].pending.partials.emplace_back(std::move(chunk));
+      touched.insert(tile_id);
+    }
+    for (const auto& neighbour : neighbourhood(m_hierarchy, source)) {
+      --m_tiles[neighbour].producers;
+      touched.insert(neighbour);
+    }
+    for (const auto& tile_id : touched)
+      ready(tile_id);
+  }
+
+  const vb::TileHierarchy& m_hierarchy;
+  journal_t* m_journal;
+  const staging_t* m_staging;
+  std::mutex m_lock;
+  std::condition_variable m_ready_cv;
+  std::unordered_map<vb::GraphId, tile_state> m_tiles;
+  std::deque<vb::GraphId> m_ready;
+  bool m_closed;
 };
 
-std::ostream &operator<<(std::ostream &out, FormOfWay fow) {
-  switch (fow) {
-  case FormOfWay::kUndefined:           out << "undefined";            break;
-  case FormOfWay::kMotorway:            out << "motorway";             break;
-  case FormOfWay::kMultipleCarriageway: out << "multiple_carriageway"; break;
-  case FormOfWay::kSingleCarriageway:   out << "single_carriageway";   break;
-  case FormOfWay::kRoundabout:          out << "roundabout";           break;
-  case FormOfWay::kTrafficSquare:       out << "traffic_square";       break;
-  case FormOfWay::kSlipRoad:            out << "sliproad";             break;
-  default:
-    out << "other";
-  }
-  return out;
-}
-
-FormOfWay form_of_way(const vb::DirectedEdge *e) {
-  bool oneway = is_oneway(e);
-  auto rclass = e->classification();
+// what one thread leaves over for other tiles, on disk instead of in memory
+class leftover_spill {
+ public:
+  leftover_spill(const std::string& spill_dir, size_t self)
+    : m_associations((bfs::path(spill_dir) / ("associations." + std::to_string(self))).string()),
+      m_partials((bfs::path(spill_dir) / ("partials." + std::to_string(self))).string()) {}
 
-  // if it's a slip road, return that. TODO: am i doing this right?
-  if (e->link()) {
-    return FormOfWay::kSlipRoad;
+  void add(leftovers_t& associations, partials_t& partials) {
+    for (auto& association : associations)
+      m_associations.add(std::move(association));
+    for (auto& chunk : partials)
+      m_partials.add(std::move(chunk));
   }
-  // if it's a roundabout, return that
-  else if (e->roundabout()) {
-    return FormOfWay::kRoundabout;
-  }
-  // if it's a motorway and it's one-way, then it's likely to be grade separated
-  else if (rclass == vb::RoadClass::kMotorway && oneway) {
-    return FormOfWay::kMotorway;
-  }
-  // if it's a major road, and it's one-way then it might be a multiple
-  // carriageway road.
-  else if (rclass <= vb::RoadClass::kTertiary && oneway) {
-    return FormOfWay::kMultipleCarriageway;
-  }
-  // not one-way, so perhaps it's a single carriageway
-  else if (rclass <= vb::RoadClass::kTertiary) {
-    return FormOfWay::kSingleCarriageway;
-  }
-  // everything else
-  else {
-    return FormOfWay::kOther;
-  }
-}
 
-class DistanceOnlyCost : public vs::DynamicCost {
-public:
-  DistanceOnlyCost(vs::TravelMode travel_mode);
-  virtual ~DistanceOnlyCost();
-  uint32_t access_mode() const;
-  bool Allowed(const vb::DirectedEdge* edge,
-               const vs::EdgeLabel& pred,
-               const vb::GraphTile*& tile,
-               const vb::GraphId& edgeid) const;
-  bool AllowedReverse(const vb::DirectedEdge* edge,
-                      const vs::EdgeLabel& pred,
-                      const vb::DirectedEdge* opp_edge,
-                      const vb::GraphTile*& tile,
-                      const vb::GraphId& edgeid) const;
-  bool Allowed(const vb::NodeInfo* node) const;
-  vs::Cost EdgeCost(const vb::DirectedEdge* edge) const;
-  const vs::EdgeFilter GetEdgeFilter() const;
-  const vs::NodeFilter GetNodeFilter() const;
-  float AStarCostFactor() const;
+  run_writer<leftover> m_associations;
+  run_writer<partial_chunk> m_partials;
 };
 
-DistanceOnlyCost::DistanceOnlyCost(vs::TravelMode travel_mode)
-  : DynamicCost(bpt::ptree(), travel_mode) {
-}
-
-DistanceOnlyCost::~DistanceOnlyCost() {
-}
+// the name of the file, next to the graph tiles, which says what went into associating them
+constexpr char kManifestName[] = "segment_associations.manifest";
 
-uint32_t DistanceOnlyCost::access_mode() const {
-  return vehicular;
-}
+// and the one which says where the time went
+constexpr char kMetricsName[] = "segment_associations.metrics.json";
 
-bool DistanceOnlyCost::Allowed(const vb::DirectedEdge* edge,
-                               const vs::EdgeLabel&,
-                               const vb::GraphTile*&,
-                               const vb::GraphId&) const {
-  return check_access(edge);
-}
+// and the one which says how far an interrupted run got
+constexpr char kJournalName[] = "segment_associations.journal";
 
-bool DistanceOnlyCost::AllowedReverse(const vb::DirectedEdge* edge,
-                                      const vs::EdgeLabel& pred,
-                                      const vb::DirectedEdge* opp_edge,
-                                      const vb::GraphTile*& tile,
-                                      const vb::GraphId& edgeid) const {
-  return check_access(edge);
-}
-
-bool DistanceOnlyCost::Allowed(const vb::NodeInfo*) const {
-  return true;
-}
-
-vs::Cost DistanceOnlyCost::EdgeCost(const vb::DirectedEdge* edge) const {
-  float edge_len(edge->length());
-  return {edge_len, edge_len};
+// 64 bit fnv-1a, plenty to tell whether a tile changed between runs
+uint64_t hash_bytes(const char* bytes, size_t size, uint64_t hash = 14695981039346656037ull) {
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(bytes[i]);
+    hash *= 1099511628211ull;
+  }
+  return hash;
 }
 
-const vs::EdgeFilter DistanceOnlyCost::GetEdgeFilter() const {
-  return [](const vb::DirectedEdge *edge) -> float {
-    return check_access(edge) ? 1.0f : 0.0f;
-  };
+uint64_t hash_file(const std::string& file_name) {
+  std::ifstream in(file_name, std::ios::binary);
+  std::vector<char> buffer(1 << 16);
+  uint64_t hash = hash_bytes(nullptr, 0);
+  while (in.read(buffer.data(), buffer.size()) || in.gcount())
+    hash = hash_bytes(buffer.data(), in.gcount(), hash);
+  return hash;
 }
 
-const vs::NodeFilter DistanceOnlyCost::GetNodeFilter() const {
-  return [](const vb::NodeInfo *) -> bool {
-    return false;
+// what went into a run and which graph tiles each osmlr tile wrote to, so the next run can work
+// out what it has to redo
+class manifest_t {
+ public:
+  struct source_t {
+    uint64_t hash;
+    std::vector<vb::GraphId> targets;
   };
-}
 
-float DistanceOnlyCost::AStarCostFactor() const {
-  return 1.0f;
-}
+  std::unordered_map<vb::GraphId, uint64_t> graph_tiles;
+  std::unordered_map<vb::GraphId, source_t> osmlr_tiles;
 
-vm::PointLL coord_for_lrp(const pbf::Segment::LocationReference &lrp) {
-  int32_t lng = lrp.coord().lng();
-  int32_t lat = lrp.coord().lat();
-  vm::PointLL coord(double(lng) / 10000000, double(lat) / 10000000);
-  return coord;
-}
-
-vb::Location location_for_lrp(const pbf::Segment::LocationReference &lrp) {
-  int32_t lng = lrp.coord().lng();
-  int32_t lat = lrp.coord().lat();
-  vb::Location location({double(lng) / 10000000, double(lat) / 10000000});
-  if(lrp.has_bear())
-    location.heading_ = lrp.bear();
-  return location;
-}
-
-vb::PathLocation loki_search_single(const vb::Location &loc, vb::GraphReader &reader, uint8_t level) {
-  //we dont want non real edges but also we want the edges to be on the right level
-  //also right now only driveable edges please
-  auto edge_filter = [level](const DirectedEdge* edge) -> float {
-    return edge->endnode().level() == level && (edge->forwardaccess() & vehicular) &&
-      !(edge->trans_up() || edge->trans_down() || edge->is_shortcut() || edge->IsTransitLine());
-  };
+  // whether a graph tile has been hashed yet, safe to ask while other threads are hashing
+  bool has_hash(const vb::GraphId& tile_id) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return graph_tiles.count(tile_id);
+  }
 
-  //we only have one location so we only get one result
-  std::vector<vb::Location> locs{loc};
-  vb::PathLocation path_loc(loc);
-  auto results = vl::Search(locs, reader, edge_filter, vl::PassThroughNodeFilter);
-  if(results.size())
-    path_loc = std::move(results.begin()->second);
-  return path_loc;
-}
+  void add_hash(const vb::GraphId& tile_id, uint64_t hash) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    graph_tiles[tile_id] = hash;
+  }
 
-edge_association::edge_association(const bpt::ptree &pt)
-  : m_reader(pt.get_child("mjolnir"))
-  , m_travel_mode(vs::TravelMode::kDrive)
-  , m_path_algo(new vt::AStarPathAlgorithm())
-  , m_costing(new DistanceOnlyCost(m_travel_mode))
-  , m_tile(nullptr) {
-}
+  // an osmlr tile has been matched, remember where its associations went
+  void produced(const vb::GraphId& source, std::vector<vb::GraphId> targets) {
+    std::sort(targets.begin(), targets.end());
+    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+    std::lock_guard<std::mutex> guard(m_lock);
+    osmlr_tiles[source].targets = std::move(targets);
+  }
 
-vb::GraphId next_edge(const GraphId& edge_id, vb::GraphReader& reader, const vb::GraphTile*& tile) {
-  //walk from this edge to the next one if there is only one choice of where
-  //to walk if there are more choices then just return invalid to signify
-  //stopping this is trying to mimic what osmlr generation does
-  if(tile->id() != edge_id.Tile_Base())
-    tile = reader.GetGraphTile(edge_id);
-  const auto* edge = tile->directededge(edge_id);
-  if(tile->id() != edge->endnode().Tile_Base())
-    tile = reader.GetGraphTile(edge->endnode());
-  const auto* node = tile->node(edge->endnode());
-  const auto* child_edge = tile->directededge(node->edge_index());
-  vb::GraphId next;
-  for(int i = 0; i < node->edge_count(); ++i) {
-    if(!child_edge->trans_up() && child_edge->use() != Use::kTransitConnection &&
-      !child_edge->trans_down() && !child_edge->IsTransitLine())
-    {
-      if(next.Is_Valid())
-        return {};
+  bool load(const std::string& file_name) {
+    std::ifstream in(file_name);
+    std::string type;
+    uint64_t id, hash;
+    while (in >> type >> id >> hash) {
+      if (type == "graph") {
+        graph_tiles[vb::GraphId(id)] = hash;
+      }
+      else if (type == "osmlr") {
+        auto& source = osmlr_tiles[vb::GraphId(id)];
+        source.hash = hash;
+        size_t count = 0;
+        in >> count;
+        for (size_t i = 0; i < count && in >> id; ++i)
+          source.targets.emplace_back(id);
+      }
       else {
-        next = edge->endnode();
-        next.fields.id = node->edge_index() + i;
+        return false;
       }
     }
-  }
-  return next;
-}
-
-struct last_tile_cache {
-  last_tile_cache(GraphReader &reader) : m_reader(reader) {}
-
-  inline const vb::GraphTile *get(vb::GraphId id) {
-    if (id.Tile_Base() != m_last_id) {
-      m_last_id = id.Tile_Base();
-      m_last_tile = m_reader.GetGraphTile(m_last_id);
+    return in.eof();
+  }
+
+  void save(const std::string& file_name) const {
+    std::ofstream out(file_name);
+    for (const auto& tile : graph_tiles)
+      out << "graph " << tile.first.value << ' ' << tile.second << '\n';
+    for (const auto& tile : osmlr_tiles) {
+      out << "osmlr " << tile.first.value << ' ' << tile.second.hash << ' ' << tile.second.targets.size();
+      for (const auto& target : tile.second.targets)
+        out << ' ' << target.value;
+      out << '\n';
     }
-    return m_last_tile;
   }
 
-private:
-  vb::GraphReader &m_reader;
-  vb::GraphId m_last_id;
-  const vb::GraphTile *m_last_tile;
+ private:
+  std::mutex m_lock;
 };
 
-vb::GraphId edge_association::find_common_edge(
-  const std::vector<vb::GraphId> &origins,
-  const std::vector<vb::GraphId> &dests) {
-
-  std::unordered_set<vb::GraphId> start_edges;
-  vb::GraphId found;
-
-  last_tile_cache cache(m_reader);
-  uint32_t count, edge_index;
-  for (auto node : origins) {
-    auto *tile = cache.get(node);
-    const auto *edges = tile->GetDirectedEdges(node.id(), count, edge_index);
-    const auto base = node.Tile_Base();
-    for (uint32_t i = 0; i < count; ++i) {
-      start_edges.insert(base + uint64_t(edge_index + i));
-    }
-  }
-
-  if (start_edges.empty()) {
-    return vb::GraphId();
-  }
-
-  for (auto node : dests) {
-    auto *tile = cache.get(node);
-    const auto *edges = tile->GetDirectedEdges(node.id(), count, edge_index);
-    const auto base = node.Tile_Base();
-    for (uint32_t i = 0; i < count; ++i) {
-      auto *edge = tile->directededge(edge_index + i);
-      auto endnode = edge->endnode();
-      auto *opp_tile = (endnode.Tile_Base() == base) ? tile : m_reader.GetGraphTile(endnode);
-      auto opp_id = opp_tile->GetOpposingEdgeId(edge);
-
-      auto itr = start_edges.find(opp_id);
-      if (itr != start_edges.end()) {
-        if (found) {
-          // already found a candidate, and can't have two candidates.
-          return vb::GraphId();
-        } else {
-          found = opp_id;
-        }
-      }
-    }
-  }
-
-  return found;
+// the whole graph tile file as it is before any associations are written to it, which is also
+// how the previous run saw it before it wrote to it. a tile that isnt there has no hash
+bool hash_graph_tile(const vb::TileHierarchy& hierarchy, const vb::GraphId& tile_id, uint64_t& hash) {
+  auto file_name = bfs::path(hierarchy.tile_dir()) / vb::GraphTile::FileSuffix(tile_id, hierarchy);
+  if (!bfs::exists(file_name))
+    return false;
+  hash = hash_file(file_name.string());
+  return true;
 }
 
-std::vector<vb::GraphId> walk(const vb::PathLocation &origin, const vb::PathLocation &dest,
-                              vb::GraphReader& reader, const vb::GraphTile* tile) {
-  //check for the easy case
-  for (const auto &origin_edge : origin.edges)
-    for (const auto &dest_edge : dest.edges)
-      if (origin_edge.id == dest_edge.id)
-        return {origin_edge.id};
-
-  //see if we can easily find a longer path
-  for (const auto &origin_edge : origin.edges) {
-    //try walking from here
-    std::vector<vb::GraphId> edges{origin_edge.id};
-    do {
-      //for each ending edge
-      for (const auto &dest_edge : dest.edges) {
-        //is does this complete the path
-        if (edges.back().id() == dest_edge.id)
-          return edges;
-      }
-      //get the next edge
-      edges.push_back(next_edge(edges.back(), reader, tile));
-      //if the edge is invalid we have no where to go
-    } while(edges.back().Is_Valid());
+// hash the osmlr tiles, every graph tile they could read from and whichever other graph tiles we
+// need to know about, those the previous run wrote to from further away say. graph tiles are
+// hashed before anything is written to them, and the journal keeps the hashes so that a resumed
+// run doesnt hash the tiles it already wrote to
+void hash_inputs(const vb::TileHierarchy& hierarchy, const std::vector<std::string>& osmlr_tiles,
+                 std::unordered_set<vb::GraphId> unique, size_t num_threads, journal_t* journal,
+                 manifest_t& manifest) {
+  for (const auto& file_name : osmlr_tiles)
+    for (const auto& neighbour : neighbourhood(hierarchy, parse_file_name(file_name)))
+      unique.insert(neighbour);
+  for (const auto& tile : manifest.graph_tiles)
+    unique.erase(tile.first);
+  std::vector<vb::GraphId> graph_tiles(unique.begin(), unique.end());
+  std::vector<uint64_t> graph_hashes(graph_tiles.size()), osmlr_hashes(osmlr_tiles.size());
+  std::vector<char> exists(graph_tiles.size());
+
+  //every thread takes every nth tile of each kind
+  std::vector<std::shared_ptr<std::thread> > threads(num_threads);
+  for (size_t t = 0; t < threads.size(); ++t) {
+    threads[t].reset(new std::thread([&, t]() {
+      for (size_t i = t; i < graph_tiles.size(); i += num_threads)
+        exists[i] = hash_graph_tile(hierarchy, graph_tiles[i], graph_hashes[i]);
+      for (size_t i = t; i < osmlr_tiles.size(); i += num_threads)
+        osmlr_hashes[i] = hash_file(osmlr_tiles[i]);
+    }));
   }
+  for (auto& thread : threads)
+    thread->join();
 
-  //fail try a route?
-  return {};
-}
-
-// given two bearings in degrees, return the unsigned angle between them.
-int bear_diff(int bear1, int bear2) {
-  int bear_diff = std::abs(bear1 - bear2);
-  if (bear_diff > 180) {
-    bear_diff = 360 - bear_diff;
-  }
-  if (bear_diff < 0) {
-    bear_diff += 360;
+  for (size_t i = 0; i < graph_tiles.size(); ++i) {
+    if (!exists[i])
+      continue;
+    manifest.graph_tiles.emplace(graph_tiles[i], graph_hashes[i]);
+    if (journal)
+      journal->hashed(graph_tiles[i], graph_hashes[i]);
   }
-  return bear_diff;
-}
-
-// given two uint32_t, return the absolute difference between them, which will
-// always fit into another uint32_t.
-uint32_t abs_u32_diff(uint32_t a, uint32_t b) {
-  return (a > b) ? (a - b) : (b - a);
-}
-
-vm::AABB2<vm::PointLL> expand_bbox_at_point(float dist, const vm::PointLL &pt) {
-  float meters_per_lng = vm::DistanceApproximator::MetersPerLngDegree(pt.lat());
-  float delta_lng = dist / meters_per_lng;
-  float delta_lat = dist / vm::kMetersPerDegreeLat;
-
-  return vm::AABB2<vm::PointLL>(
-    {pt.lng() - delta_lng, pt.lat() - delta_lat},
-    {pt.lng() + delta_lng, pt.lat() + delta_lat});
+  for (size_t i = 0; i < osmlr_tiles.size(); ++i)
+    manifest.osmlr_tiles[parse_file_name(osmlr_tiles[i])].hash = osmlr_hashes[i];
 }
 
-std::vector<vb::GraphId> edge_association::find_nodes_within(float dist, const vm::PointLL &pt) {
-
-  const auto bbox = expand_bbox_at_point(dist, pt);
-  return vl::nodes_in_bbox(bbox, m_reader);
+// leftovers can go further than the tiles around the osmlr tiles, those tiles werent hashed up
+// front so they are hashed just before they are first written to
+void hash_before_write(const vb::TileHierarchy& hierarchy, const vb::GraphId& tile_id, manifest_t* manifest,
+                       journal_t* journal) {
+  uint64_t hash;
+  if (!manifest || manifest->has_hash(tile_id) || !hash_graph_tile(hierarchy, tile_id, hash))
+    return;
+  if (journal)
+    journal->hashed(tile_id, hash);
+  manifest->add_hash(tile_id, hash);
 }
 
-std::vector<vb::GraphId> edge_association::match_edges(const pbf::Segment &segment, uint8_t level) {
-  const size_t size = segment.lrps_size();
-  assert(size >= 2);
-
-  std::vector<std::vector<edge_score> > locs;
-  locs.resize(size - 1);
-
-  auto origin_coord = coord_for_lrp(segment.lrps(0));
-  auto origin_nodes = find_nodes_within(10.0, origin_coord);
-  if (origin_nodes.size() == 0) {
-    LOG_WARN("Unable to find node near origin " + std::to_string(origin_coord) + ". Segment cannot be matched, discarding.");
-    return std::vector<vb::GraphId>();
-  }
-
-  auto dest_coord = coord_for_lrp(segment.lrps(size - 1));
-  auto dest_nodes = find_nodes_within(10.0, dest_coord);
-  if (dest_nodes.size() == 0) {
-    LOG_WARN("Unable to find node near destination " + std::to_string(dest_coord) + ". Segment cannot be matched, discarding.");
-    return std::vector<vb::GraphId>();
-  }
-
-  // calculate total length of the segment for comparison to common edges or
-  // short "walked" paths.
-  uint32_t total_length = 0;
-  for (const auto &lrp : segment.lrps()) {
-    total_length += lrp.length();
-  }
-
-  auto common_edge_id = find_common_edge(origin_nodes, dest_nodes);
-  if (common_edge_id) {
-    // TODO: check bearing, length, FRC, FOW, etc...
+// what an incremental run has to redo. osmlr tiles whose input changed are rerun and all the graph
+// tiles they wrote to or could write to are rewritten. other osmlr tiles which wrote to those tiles
+// are rerun too, but only to fill those tiles back in. every other graph tile is copied from the
+// previous run as is
+struct incremental_plan {
+  std::unordered_set<vb::GraphId> changed, rerun, rewrite;
 
-    auto *tile = m_reader.GetGraphTile(common_edge_id);
-    auto *edge = tile->directededge(common_edge_id);
-
-    auto &lrp = segment.lrps(0);
-
-    vb::RoadClass road_class = vb::RoadClass(lrp.start_frc());
-    int bear = bear_diff(bearing(tile, common_edge_id, 0.0), lrp.bear());
-    int len = abs_u32_diff(edge->length(), total_length);
-    FormOfWay fow = FormOfWay(lrp.start_fow());
-
-    if ((road_class == edge->classification()) &&
-        (bear < 10) && (len < 10) &&
-        (fow == form_of_way(edge))) {
-
-      // if the edge matches all our expectations, then we can just assume
-      // we found the right edge and return it. this should be significantly
-      // faster than running a whole route to check.
-      std::vector<vb::GraphId> edges;
-      edges.emplace_back(common_edge_id);
-      return edges;
-    }
+  bool runs(const vb::GraphId& source) const {
+    return changed.count(source) || rerun.count(source);
   }
 
-  auto origin = loki_search_single(vb::Location(origin_coord), m_reader, level);
-  std::remove_if(origin.edges.begin(), origin.edges.end(), [](const vb::PathLocation::PathEdge& e){return e.end_node();});
-  auto dest = loki_search_single(vb::Location(location_for_lrp(segment.lrps(size - 1))), m_reader, level);
-  std::remove_if(dest.edges.begin(), dest.edges.end(), [](const vb::PathLocation::PathEdge& e){return e.begin_node();});
-
-  // check if its a trivial path between edges
-  auto walked_edges = walk(origin, dest, m_reader, m_tile);
-  if (walked_edges.size()) {
-    // TODO: check bearing, length, FRC, FOW, etc...
-
-    uint32_t walked_length = 0;
-    for (auto edge_id : walked_edges) {
-      auto *tile = m_reader.GetGraphTile(walked_edges.front());
-      auto *edge = tile->directededge(walked_edges.front());
-      walked_length += edge->length();
-    }
-
-    auto *tile = m_reader.GetGraphTile(walked_edges.front());
-    auto *edge = tile->directededge(walked_edges.front());
-
-    auto &lrp = segment.lrps(0);
-
-    vb::RoadClass road_class = vb::RoadClass(lrp.start_frc());
-    int bear = bear_diff(bearing(tile, walked_edges.front(), 0.0), lrp.bear());
-    int len = abs_u32_diff(walked_length, total_length);
-    FormOfWay fow = FormOfWay(lrp.start_fow());
-
-    if ((road_class == edge->classification()) &&
-        (bear < 10) && (len < 10) &&
-        (fow == form_of_way(edge))) {
-
-      // if the edge matches all our expectations, then we can just assume
-      // we found the right edge and return it. this should be significantly
-      // faster than running a whole route to check.
-      // TODO: the first and last match edges could be partial, the TrafficAssociation
-      // must be made aware of this and use the percentages returned in the PathEdge
-      return walked_edges;
-    }
+  // whether to keep the associations a source made for a target
+  bool keep(const vb::GraphId& source, const vb::GraphId& target) const {
+    return changed.count(source) || rewrite.count(target);
   }
+};
 
-  // check all the interim points of the location reference
-  std::vector<vb::GraphId> edges;
-  for (size_t i = 0; i < size - 1; ++i) {
-    auto &lrp = segment.lrps(i);
-    auto coord = coord_for_lrp(lrp);
-    auto next_coord = coord_for_lrp(segment.lrps(i+1));
-
-    vb::RoadClass road_class = vb::RoadClass(lrp.start_frc());
-
-    dest = loki_search_single(location_for_lrp(segment.lrps(i+1)), m_reader, level);
-    if (dest.edges.size() == 0) {
-      LOG_WARN("Unable to find edge near point " + std::to_string(next_coord) + ". Segment cannot be matched, discarding.");
-      return std::vector<vb::GraphId>();
-    }
-
-    // make sure there's no state left over from previous paths
-    m_path_algo->Clear();
-    auto path = m_path_algo->GetBestPath(
-      origin, dest, m_reader, &m_costing, m_travel_mode);
-
-    if (path.empty()) {
-      // what to do if there's no path?
-      LOG_WARN("No route to destination " + std::to_string(next_coord) + " from origin point " + std::to_string(coord) + ". Segment cannot be matched, discarding.");
-      return std::vector<vb::GraphId>();
-    }
-
-    {
-      auto last_edge_id = path.back().edgeid;
-      auto *tile = m_reader.GetGraphTile(last_edge_id);
-      auto *edge = tile->directededge(last_edge_id);
-      auto node_id = edge->endnode();
-      auto *ntile = (last_edge_id.Tile_Base() == node_id.Tile_Base()) ? tile : m_reader.GetGraphTile(node_id);
-      auto *node = ntile->node(node_id);
-      auto dist = node->latlng().Distance(next_coord);
-      if (dist > 10.0f) {
-        LOG_WARN("Route to destination " + std::to_string(next_coord) + " from origin point " + std::to_string(coord) + " ends more than 10m away: " + std::to_string(node->latlng()) + ". Segment cannot be matched, discarding.");
-        return std::vector<vb::GraphId>();
-      }
-    }
-
-    int score = 0;
-    uint32_t sum = 0;
-    for (auto &p : path) {
-      sum += p.elapsed_time;
-    }
-    score += std::abs(int(sum) - int(lrp.length())) / 10;
-
-    auto edge_id = path.front().edgeid;
-    auto *tile = m_reader.GetGraphTile(edge_id);
-    auto *edge = tile->directededge(edge_id);
-
-    if (!check_access(edge)) {
-      LOG_WARN("Edge " + std::to_string(edge_id) + " not accessible. Segment cannot be matched, discarding.");
-      return std::vector<vb::GraphId>();
-    }
-
-    score += std::abs(int(road_class) - int(edge->classification()));
-
-    bool found = false;
-    for (auto &e : origin.edges) {
-      if (e.id == edge_id) {
-        found = true;
-        score += int(e.projected.Distance(coord));
-
-        int bear1 = bearing(tile, edge_id, e.dist);
-        int bear2 = lrp.bear();
-        score += bear_diff(bear1, bear2) / 10;
+incremental_plan plan_incremental(const vb::TileHierarchy& hierarchy, const manifest_t& previous,
+                                  const manifest_t& current) {
+  incremental_plan plan;
+  auto graph_changed = [&previous, &current](const vb::GraphId& tile_id) {
+    auto before = previous.graph_tiles.find(tile_id);
+    auto after = current.graph_tiles.find(tile_id);
+    if (before == previous.graph_tiles.end() || after == current.graph_tiles.end())
+      return (before == previous.graph_tiles.end()) != (after == current.graph_tiles.end());
+    return before->second != after->second;
+  };
 
+  //graph tiles which changed have to be redone from scratch
+  for (const auto& tile : current.graph_tiles)
+    if (graph_changed(tile.first))
+      plan.rewrite.insert(tile.first);
+
+  //a tile we cant tell hasnt changed cant be copied either
+  for (const auto& source : previous.osmlr_tiles)
+    for (const auto& target : source.second.targets)
+      if (!previous.graph_tiles.count(target) || !current.graph_tiles.count(target))
+        plan.rewrite.insert(target);
+
+  //osmlr tiles change when they do or when the graph around them does
+  for (const auto& source : current.osmlr_tiles) {
+    auto before = previous.osmlr_tiles.find(source.first);
+    auto neighbours = neighbourhood(hierarchy, source.first);
+    bool changed = before == previous.osmlr_tiles.end() || before->second.hash != source.second.hash ||
+      std::any_of(neighbours.begin(), neighbours.end(), graph_changed);
+    if (!changed)
+      continue;
+    plan.changed.insert(source.first);
+    plan.rewrite.insert(neighbours.begin(), neighbours.end());
+    if (before != previous.osmlr_tiles.end())
+      plan.rewrite.insert(before->second.targets.begin(), before->second.targets.end());
+  }
+
+  //osmlr tiles which went away take their associations with them
+  for (const auto& source : previous.osmlr_tiles)
+    if (!current.osmlr_tiles.count(source.first))
+      plan.rewrite.insert(source.second.targets.begin(), source.second.targets.end());
+
+  //everyone else who wrote to a tile we are rewriting has to do so again
+  for (const auto& source : previous.osmlr_tiles) {
+    if (!current.osmlr_tiles.count(source.first) || plan.changed.count(source.first))
+      continue;
+    for (const auto& target : source.second.targets) {
+      if (plan.rewrite.count(target)) {
+        plan.rerun.insert(source.first);
         break;
       }
     }
-    if (!found) {
-      LOG_WARN("Unable to find edge " + std::to_string(edge_id) + " at origin point " + std::to_string(origin.latlng_) + ". Segment cannot be matched, discarding.");
-      return std::vector<vb::GraphId>();
-    }
-
-    // form of way isn't really a metric space...
-    FormOfWay fow1 = form_of_way(edge);
-    FormOfWay fow2 = FormOfWay(lrp.start_fow());
-    score += (fow1 == fow2) ? 0 : 5;
-
-    for (const auto &info : path) {
-      edges.emplace_back(info.edgeid);
-    }
-
-    // use dest as next origin
-    std::swap(origin, dest);
-  }
-
-  // remove duplicate instances of the edge ID in the path info
-  auto new_end = std::unique(edges.begin(), edges.end());
-  edges.erase(new_end, edges.end());
-
-  return edges;
-}
-
-static const float kApproxEqualDistanceSquared = 100.0f;
-
-bool approx_equal(const vm::PointLL &a, const vm::PointLL &b) {
-  return a.DistanceSquared(b) <= kApproxEqualDistanceSquared;
-}
-
-vm::PointLL edge_association::lookup_end_coord(const vb::GraphId& edge_id) {
-  auto *tile = m_reader.GetGraphTile(edge_id);
-  auto *edge = tile->directededge(edge_id);
-  auto node_id = edge->endnode();
-  auto *node_tile = tile;
-  if (edge_id.Tile_Base() != node_id.Tile_Base()) {
-    node_tile = m_reader.GetGraphTile(node_id);
   }
-  auto *node = node_tile->node(node_id);
-  return node->latlng();
+  return plan;
 }
 
-vm::PointLL edge_association::lookup_start_coord(const vb::GraphId& edge_id) {
-  auto *tile = m_reader.GetGraphTile(edge_id);
-  auto *edge = tile->directededge(edge_id);
-  auto opp_index = edge->opp_index();
-  auto node_id = edge->endnode();
-  auto *node_tile = tile;
-  if (edge_id.Tile_Base() != node_id.Tile_Base()) {
-    node_tile = m_reader.GetGraphTile(node_id);
+// bring forward the graph tiles from the previous run which we aren't going to rewrite
+size_t copy_unchanged(const vb::TileHierarchy& hierarchy, const std::string& previous_dir, const manifest_t& previous,
+                      const incremental_plan& plan) {
+  std::unordered_set<vb::GraphId> copied;
+  for (const auto& source : previous.osmlr_tiles) {
+    for (const auto& target : source.second.targets) {
+      if (plan.rewrite.count(target) || !copied.insert(target).second)
+        continue;
+      auto suffix = vb::GraphTile::FileSuffix(target, hierarchy);
+      bfs::copy_file(bfs::path(previous_dir) / suffix, bfs::path(hierarchy.tile_dir()) / suffix,
+                     bfs::copy_option::overwrite_if_exists);
+    }
   }
-  auto *node = node_tile->node(node_id);
-  return lookup_end_coord(node_id.Tile_Base() + uint64_t(node->edge_index() + opp_index));
+  return copied.size();
 }
 
-void edge_association::match_segment(vb::GraphId segment_id, const pbf::Segment &segment) {
-  auto edges = match_edges(segment, segment_id.level());
-  if (edges.empty()) {
-    LOG_WARN("Unable to match segment " + std::to_string(segment_id) + ".");
-    return;
-  }
-
-  auto seg_start = coord_for_lrp(segment.lrps(0));
-  auto seg_end = coord_for_lrp(segment.lrps(segment.lrps_size() - 1));
+void add_local_associations(const bpt::ptree &pt, std::vector<work_queue>& queues, size_t self,
+  leftover_queue& leftovers, leftover_spill* spill, const staging_t* staging, manifest_t& manifest,
+  const incremental_plan* plan, metrics_t& metrics) {
 
-  auto edges_start = lookup_start_coord(edges.front());
-  auto edges_end = lookup_end_coord(edges.back());
-
-  if (approx_equal(seg_start, edges_start) &&
-      approx_equal(seg_end, edges_end)) {
-    if (edges.size() == 1) {
-      // if the segment matches to one edge exactly, then we can use it
-      // directly. if not then it requires a level of indirection via
-      // "chunks".
-      assign_one_to_one(edges.front(), segment_id);
+  //this holds the extra data before we serialize it to the extra section
+  //of a tile.
+  edge_association e(pt, metrics);
+  std::unique_ptr<vb::TileHierarchy> staged;
+  if (staging)
+    staged.reset(new vb::TileHierarchy(staging->directory(kLocalRound)));
+
+  //get a batch of files to work with
+  tile_batch_t batch;
+  while(take_batch(queues, self, batch)) {
+    for(const auto& osmlr_filename : batch) {
+      //get the local associations
+      auto source = parse_file_name(osmlr_filename);
+      bool write_local = !plan || plan->keep(source, source);
+      bool staging_local = write_local && staging && staging->stage(source, kLocalRound);
+      e.add_tile(osmlr_filename, write_local, staging_local ? staged.get() : nullptr);
+      if (staging_local)
+        staging->sync(source, kLocalRound);
+      auto associations = e.take_leftovers();
+      auto partials = e.take_partials();
+
+      //remember where this osmlr tile's associations go
+      std::vector<vb::GraphId> targets{source};
+      for (const auto& association : associations)
+        targets.push_back(association.edge.Tile_Base());
+      for (const auto& chunk : partials)
+        targets.push_back(chunk.edge.Tile_Base());
+
+      //when incremental drop what would go to the tiles that were copied from the last run
+      if (plan) {
+        associations.erase(std::remove_if(associations.begin(), associations.end(),
+          [plan, &source](const leftover& association) {
+            return !plan->keep(source, association.edge.Tile_Base()); }), associations.end());
+        partials.erase(std::remove_if(partials.begin(), partials.end(),
+          [plan, &source](const partial_chunk& chunk) {
+            return !plan->keep(source, chunk.edge.Tile_Base()); }), partials.end());
+      }
 
-    } else {
-      // more than one edge, but matches the segment exactly. this is a
-      // "one to many" case, and can also be looked up directly.
-      assign_one_to_many(edges, segment_id);
+      //let the writers have the rest, or put it on disk until everything is done
+      if (spill)
+        spill->add(associations, partials);
+      else
+        leftovers.finished(source, targets, std::move(associations), std::move(partials));
+      manifest.produced(source, std::move(targets));
     }
-  } else {
-    // save this for later, when we'll gather up all partial segments
-    // and try to build chunks out of them.
-    save_chunk_for_later(edges, segment_id);
   }
 }
 
-// A single traffic segment maps to a single valhalla edge.
-void edge_association::assign_one_to_one(const vb::GraphId& edge_id,
-                                         const vb::GraphId& segment_id) {
-  // Edge starts at the beginning of the traffic segment, ends on the end of
-  // the traffic segment
-  vb::TrafficChunk assoc(segment_id, 0.0f, 1.0f, true, true);
-
-  // Store the local ones and leave the non local for later
-  if(m_tile_builder->id() == edge_id.Tile_Base())
-    m_tile_builder->AddTrafficSegment(edge_id, assoc);
-  else
-    m_leftover_associations.emplace_back(std::make_pair(edge_id, assoc));
-}
-
-// A single traffic segment maps to multiple valhalla edges. Each edge is
-// entirely within the segment.
-void edge_association::assign_one_to_many(const std::vector<vb::GraphId> &edges,
-                                          const vb::GraphId& segment_id) {
-  for (size_t i = 0; i < edges.size(); i++) {
-    // Form association for this edge. First edge "starts" the traffic
-    // segment and the last edge ends the segment.
-    const auto& edge_id = edges[i];
-    vb::TrafficChunk assoc(segment_id, 0.0f, 1.0f, (i == 0), (i == edges.size() - 1));
-
-    // Store the local segment and leave the non local for later
-    if(m_tile_builder->id() == edge_id.Tile_Base())
-      m_tile_builder->AddTrafficSegment(edge_id, assoc);
-    else
-      m_leftover_associations.emplace_back(std::make_pair(edge_id, assoc));
+// write what the other osmlr tiles left over for this graph tile
+void write_leftovers(const TileHierarchy& hierarchy, const vb::GraphId& tile_id, tile_leftovers& associations,
+  metrics_t& metrics) {
+  auto start = steady_clock::now();
+  vj::GraphTileBuilder tile_builder(hierarchy, tile_id, false);
+  tile_builder.InitializeTrafficSegments();
+  for(const auto& association : associations.associations)
+    tile_builder.AddTrafficSegment(association.edge,
+      vb::TrafficChunk(association.segment, 0.0f, 1.0f, association.starts, association.ends));
+  if(associations.partials.size()) {
+    //whatever was written to the tile before this counts as covered, as do the whole edges above
+    vb::GraphTile tile(hierarchy, tile_id);
+    for(const auto& chunk : merge_partials(associations.partials, associations.associations, tile))
+      tile_builder.AddTrafficSegment(chunk.edge,
+        vb::TrafficChunk(chunk.segment, chunk.begin, chunk.end, chunk.starts, chunk.ends));
   }
+  tile_builder.UpdateTrafficSegments();
+  metrics.leftovers.add(micros_since(start));
 }
 
-void edge_association::save_chunk_for_later(const std::vector<vb::GraphId> &edges, vb::GraphId segment_id) {
-  partial_chunk tmp;
-  tmp.edges = edges;
-  tmp.segments.push_back(segment_id);
-  m_partial_chunks.emplace_back(std::move(tmp));
-}
+void add_leftover_associations(const bpt::ptree &pt, leftover_queue& leftovers, const staging_t* staging,
+  manifest_t* manifest, journal_t* journal, metrics_t& metrics) {
 
-vb::GraphId parse_file_name(const std::string &file_name) {
-  return vb::GraphTile::GetTileId(file_name);
-}
+  //something so we can open up a tile builder
+  TileHierarchy hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
 
-void edge_association::add_tile(const std::string &file_name) {
-  //read the osmlr tile
-  pbf::Tile tile;
-  {
-    std::ifstream in(file_name);
-    if (!tile.ParseFromIstream(&in)) {
-      throw std::runtime_error("Unable to parse traffic segment file.");
+  //get a tile to work with, and write to a copy of it when the queue is going to commit it
+  vb::GraphId tile_id;
+  tile_leftovers associations;
+  std::string round;
+  while(leftovers.pop(tile_id, associations, round)) {
+    hash_before_write(hierarchy, tile_id, manifest, journal);
+    if (staging && staging->stage(tile_id, round)) {
+      TileHierarchy staged(staging->directory(round));
+      write_leftovers(staged, tile_id, associations, metrics);
+      staging->sync(tile_id, round);
     }
-  }
-
-  //get a tile builder ready for this tile
-  auto base_id = parse_file_name(file_name);
-  m_tile_builder.reset(new vj::GraphTileBuilder(m_reader.GetTileHierarchy(), base_id, false));
-  m_tile_builder->InitializeTrafficSegments();
-  m_tile = m_reader.GetGraphTile(base_id);
-
-  //do the matching of the segments in this osmlr tile
-  std::cout.precision(16);
-  size_t entry_id = 0;
-  for (auto &entry : tile.entries()) {
-    if (!entry.has_marker()) {
-      assert(entry.has_segment());
-      auto &segment = entry.segment();
-      match_segment(base_id + entry_id, segment);
+    else {
+      write_leftovers(hierarchy, tile_id, associations, metrics);
     }
-    entry_id += 1;
+    leftovers.written(tile_id);
   }
-
-  //finish this tile
-  m_reader.Clear();
-  m_tile_builder->UpdateTrafficSegments();
 }
 
-void add_local_associations(const bpt::ptree &pt, std::deque<std::string>& osmlr_tiles, std::mutex& lock,
-  std::promise<edge_association>& association) {
-
-  //this holds the extra data before we serialize it to the extra section
-  //of a tile.
-  edge_association e(pt);
-
-  while(true) {
-    //get a file to work with
-    std::string osmlr_filename;
-    lock.lock();
-    if(osmlr_tiles.size()) {
-      osmlr_filename = std::move(osmlr_tiles.front());
-      osmlr_tiles.pop_front();
-    }
-    lock.unlock();
-    if(osmlr_filename.empty())
-      break;
-
-    //get the local associations
-    e.add_tile(osmlr_filename);
-  }
-
-  //pass it back
-  association.set_value(std::move(e));
-}
-
-void add_leftover_associations(const bpt::ptree &pt, std::unordered_map<GraphId, leftovers_t>& leftovers,
-  std::mutex& lock) {
+void add_spilled_associations(const bpt::ptree &pt, std::vector<std::unique_ptr<leftover_spill> >& spills,
+  manifest_t* manifest, metrics_t& metrics) {
 
   //something so we can open up a tile builder
   TileHierarchy hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
 
-  while(true) {
-    //get a file to work with
-    leftovers_t associations;
-    lock.lock();
-    if(leftovers.size()) {
-      associations = std::move(leftovers.begin()->second);
-      leftovers.erase(leftovers.begin());
-    }
-    lock.unlock();
-    if(associations.empty())
-      break;
-
-    //write the associations
-    vj::GraphTileBuilder tile_builder(hierarchy, associations.front().first.Tile_Base(), false);
-    tile_builder.InitializeTrafficSegments();
-    for(const auto& association : associations)
-      tile_builder.AddTrafficSegment(association.first, association.second);
-    tile_builder.UpdateTrafficSegments();
-  }
+  //merge all the runs of all the threads
+  std::vector<std::string> association_files, partial_files;
+  for (auto& spill : spills) {
+    spill->m_associations.flush();
+    spill->m_partials.flush();
+    association_files.insert(association_files.end(), spill->m_associations.files().begin(),
+                             spill->m_associations.files().end());
+    partial_files.insert(partial_files.end(), spill->m_partials.files().begin(), spill->m_partials.files().end());
+  }
+  run_merger<leftover> associations(association_files);
+  run_merger<partial_chunk> partials(partial_files);
+
+  //sweep through the tiles in order writing each one once
+  uint64_t association_key, partial_key;
+  bool more_associations = associations.peek(association_key), more_partials = partials.peek(partial_key);
+  while (more_associations || more_partials) {
+    auto key = more_associations && more_partials ? std::min(association_key, partial_key) :
+               (more_associations ? association_key : partial_key);
+    tile_leftovers tile;
+    associations.take(key, tile.associations);
+    partials.take(key, tile.partials);
+    hash_before_write(hierarchy, vb::GraphId(key), manifest, nullptr);
+    write_leftovers(hierarchy, vb::GraphId(key), tile, metrics);
+    more_associations = associations.peek(association_key);
+    more_partials = partials.peek(partial_key);
+  }
+
+  //the runs arent needed anymore
+  for (const auto& file : association_files)
+    bfs::remove(file);
+  for (const auto& file : partial_files)
+    bfs::remove(file);
 }
 
 } // anonymous namespace
 
 int main(int argc, char** argv) {
-  std::string config, tile_dir;
+  std::string config, tile_dir, previous_tile_dir, spill_dir;
   unsigned int num_threads = 1;
+  bool resume = false, write_manifest = false;
 
   bpo::options_description options("valhalla_associate_segments " VERSION "\n"
                                    "\n"
@@ -927,6 +709,18 @@ int main(int argc, char** argv) {
     ("version,v", "Print the version of this software.")
     ("osmlr-tile-dir,t", bpo::value<std::string>(&tile_dir), "Location of traffic segment tiles.")
     ("concurrency,j", bpo::value<unsigned int>(&num_threads), "Number of threads to use.")
+    ("previous-tile-dir,p", bpo::value<std::string>(&previous_tile_dir), "Graph tiles associated by a previous run. "
+     "Only the osmlr tiles whose segments or surrounding graph tiles changed since then are associated again, "
+     "graph tiles none of those write to are copied from here.")
+    ("manifest,m", bpo::bool_switch(&write_manifest), "Hash the inputs and write a manifest of them next to the "
+     "graph tiles so that a later run can be given these as its --previous-tile-dir. Incremental runs always do.")
+    ("resume,r", bpo::bool_switch(&resume), "Pick up an interrupted run where it left off rather than starting over. "
+     "Must be given the same arguments and inputs as the run it resumes.")
+    ("spill-dir,s", bpo::value<std::string>(&spill_dir), "Keep what osmlr tiles leave over for other graph tiles in "
+     "sorted runs in this directory rather than in memory and write them all, one graph tile at a time, once every "
+     "osmlr tile is done. Such runs cannot be resumed: graph tiles are written in place, without staging or a "
+     "journal, so if one is interrupted the graph tiles are left partly associated and it has to be redone from "
+     "fresh graph tiles.")
     // positional arguments
     ("config", bpo::value<std::string>(&config), "Valhalla configuration file [required]");
 
@@ -960,8 +754,20 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
-  //queue up all the work we'll be doing
-  std::deque<std::string> osmlr_tiles;
+  if (resume && vm.count("spill-dir")) {
+    std::cout << "Runs which spill leftovers to disk cannot be resumed.\n";
+    return EXIT_FAILURE;
+  }
+
+  //configure logging
+  vm::logging::Configure({{"type","std_err"},{"color","true"}});
+
+  //parse the config
+  bpt::ptree pt;
+  bpt::read_json(config.c_str(), pt);
+
+  //find all the work we'll be doing
+  std::vector<std::string> osmlr_tiles;
   auto itr = bfs::recursive_directory_iterator(tile_dir);
   auto end = bfs::recursive_directory_iterator();
   for (; itr != end; ++itr) {
@@ -973,52 +779,189 @@ int main(int argc, char** argv) {
       }
     }
   }
-  //std::random_shuffle(osmlr_tiles.begin(), osmlr_tiles.end());
-
-  //configure logging
-  vm::logging::Configure({{"type","std_err"},{"color","true"}});
-
-  //parse the config
-  bpt::ptree pt;
-  bpt::read_json(config.c_str(), pt);
 
-  //fire off some threads to do the work
-  LOG_INFO("Associating local traffic segments with " + std::to_string(num_threads) + " threads");
-  std::vector<std::shared_ptr<std::thread> > threads(num_threads);
-  std::list<std::promise<edge_association> > results;
-  std::mutex lock;
-  for (auto& thread : threads) {
-    results.emplace_back();
-    thread.reset(new std::thread(add_local_associations, std::cref(pt), std::ref(osmlr_tiles),
-                                 std::ref(lock), std::ref(results.back())));
+  //every thread has its own graph reader, loki and the router cant be handed a cache to share, so
+  //they split the one cache budget from the config. that way memory use stays flat no matter how
+  //many threads we run, and since each thread works its way through an area of its own the tiles
+  //it keeps are the ones it needs
+  num_threads = std::max(num_threads, 1u);
+  auto max_cache_size = pt.get<size_t>("mjolnir.max_cache_size", kDefaultMaxCacheSize);
+  pt.put("mjolnir.max_cache_size", max_cache_size / num_threads);
+
+  //what the previous run worked from and where it wrote
+  vb::TileHierarchy hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
+  bool incremental = vm.count("previous-tile-dir");
+  manifest_t previous;
+  if (incremental) {
+    auto previous_manifest = (bfs::path(previous_tile_dir) / kManifestName).string();
+    if (!previous.load(previous_manifest)) {
+      LOG_ERROR("Unable to read the manifest of the previous run " + previous_manifest);
+      return EXIT_FAILURE;
+    }
   }
 
-  //wait for it to finish
-  for (auto& thread : threads)
-    thread->join();
-  LOG_INFO("Finished");
-
-  //queue up the leftovers
-  LOG_INFO("Associating neighbouring traffic segments with " + std::to_string(num_threads) + " threads");
-  std::unordered_map<GraphId, leftovers_t> leftovers;
-  for (auto& result : results) {
-    auto associations = result.get_future().get();
-    for(const auto& association : associations.leftovers()) {
-      auto leftover = leftovers.insert({association.first.Tile_Base(), {}}).first;
-      leftover->second.push_back(association);
+  //keep track of what gets done so we can carry on from there if we get interrupted, spilled
+  //leftovers only get written at the very end so there is nothing to carry on from
+  auto journal_file = (bfs::path(hierarchy.tile_dir()) / kJournalName).string();
+  std::unique_ptr<journal_t> journal;
+  std::unique_ptr<staging_t> staging;
+  std::vector<std::unique_ptr<leftover_spill> > spills;
+  try {
+    if (vm.count("spill-dir")) {
+      bfs::remove(journal_file);
+      bfs::create_directories(spill_dir);
+      for (size_t i = 0; i < num_threads; ++i)
+        spills.emplace_back(new leftover_spill(spill_dir, i));
+    }
+    else {
+      journal.reset(new journal_t(journal_file, resume));
+      //finish moving whatever the journal says was written into place and forget the rest
+      staging.reset(new staging_t(hierarchy));
+      auto committed = association::recover(*journal, *staging);
+      if (committed)
+        LOG_INFO("Committed " + std::to_string(committed) + " graph tiles the interrupted run had written");
     }
   }
+  catch (const std::exception& e) {
+    LOG_ERROR(e.what());
+    return EXIT_FAILURE;
+  }
+  if (resume)
+    LOG_INFO("Resuming after " + std::to_string(journal->finished.size()) + " osmlr tiles");
+
+  //remember what we are working from so that the next run can skip whatever hasnt changed. every
+  //tile the previous run wrote to needs a hash as well or we cant tell whether it is safe to copy.
+  //graph tiles are hashed before we write anything to them, when resuming some already have been
+  //written to so what they hashed to beforehand comes from the journal
+  write_manifest = write_manifest || incremental;
+  manifest_t manifest;
+  if (write_manifest) {
+    if (journal)
+      manifest.graph_tiles = journal->hashes;
+    LOG_INFO("Hashing " + std::to_string(osmlr_tiles.size()) + " osmlr tiles and the graph tiles around them");
+    std::unordered_set<vb::GraphId> targets;
+    for (const auto& source : previous.osmlr_tiles)
+      targets.insert(source.second.targets.begin(), source.second.targets.end());
+    hash_inputs(hierarchy, osmlr_tiles, std::move(targets), num_threads, journal.get(), manifest);
+  }
+
+  //only redo what changed since the previous run and take the rest from it
+  std::unique_ptr<incremental_plan> plan;
+  if (incremental) {
+    plan.reset(new incremental_plan(plan_incremental(hierarchy, previous, manifest)));
+    //copying again would throw away what the interrupted run already wrote into them
+    size_t copied = 0;
+    if (!journal || !journal->copied) {
+      copied = copy_unchanged(hierarchy, previous_tile_dir, previous, *plan);
+      if (journal)
+        journal->copied_forward();
+    }
 
-  //write all the leftovers
-  for (auto& thread : threads) {
-    results.emplace_back();
-    thread.reset(new std::thread(add_leftover_associations, std::cref(pt), std::ref(leftovers),
-                                 std::ref(lock)));
+    //osmlr tiles we skip still write where they did last time
+    for (auto& source : manifest.osmlr_tiles)
+      if (!plan->runs(source.first))
+        source.second.targets = previous.osmlr_tiles[source.first].targets;
+    osmlr_tiles.erase(std::remove_if(osmlr_tiles.begin(), osmlr_tiles.end(), [&plan](const std::string& file_name) {
+      return !plan->runs(parse_file_name(file_name)); }), osmlr_tiles.end());
+    LOG_INFO(std::to_string(plan->changed.size()) + " osmlr tiles changed, " + std::to_string(plan->rerun.size()) +
+             " more write to the " + std::to_string(plan->rewrite.size()) + " graph tiles that need redoing, " +
+             std::to_string(copied) + " graph tiles copied from the previous run");
+  }
+
+  //hand out contiguous runs of spatially sorted batches so each thread starts in its own area
+  std::vector<vb::GraphId> sources;
+  for (const auto& osmlr_tile : osmlr_tiles)
+    sources.emplace_back(parse_file_name(osmlr_tile));
+  std::unordered_set<vb::GraphId> done;
+  if (journal)
+    for (const auto& finished : journal->finished)
+      done.insert(finished.source);
+  osmlr_tiles.erase(std::remove_if(osmlr_tiles.begin(), osmlr_tiles.end(), [&done](const std::string& file_name) {
+    return done.find(parse_file_name(file_name)) != done.end(); }), osmlr_tiles.end());
+  std::vector<work_queue> queues(num_threads);
+  association::deal_batches(association::make_batches(hierarchy, std::move(osmlr_tiles), num_threads), queues);
+
+  //fire off some threads to do the work, the leftovers get written as soon as all the osmlr
+  //tiles around their tile are done rather than waiting for every last tile to finish
+  LOG_INFO("Associating traffic segments with " + std::to_string(num_threads) + " threads");
+  leftover_queue leftovers(hierarchy, sources, journal.get(), staging.get());
+
+  //what the interrupted run finished only needs the leftovers that never made it into a tile
+  for (size_t i = 0; journal && i < journal->finished.size(); ++i) {
+    auto& finished = journal->finished[i];
+    auto unwritten = [&journal, i](const vb::GraphId& tile_id) {
+      auto flushed = journal->flushed_upto.find(tile_id);
+      return flushed == journal->flushed_upto.end() || flushed->second <= i;
+    };
+    finished.leftovers.erase(std::remove_if(finished.leftovers.begin(), finished.leftovers.end(),
+      [&unwritten](const leftover& association) {
+        return !unwritten(association.edge.Tile_Base()); }), finished.leftovers.end());
+    finished.partials.erase(std::remove_if(finished.partials.begin(), finished.partials.end(),
+      [&unwritten](const partial_chunk& chunk) { return !unwritten(chunk.edge.Tile_Base()); }), finished.partials.end());
+    manifest.produced(finished.source, std::move(finished.targets));
+    leftovers.replay(finished.source, std::move(finished.leftovers), std::move(finished.partials));
+  }
+  if (journal)
+    journal->finished.clear();
+  std::vector<metrics_t> metrics(num_threads * 2);
+  std::vector<std::shared_ptr<std::thread> > threads(num_threads);
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i].reset(new std::thread(add_local_associations, std::cref(pt), std::ref(queues), i,
+                                     std::ref(leftovers), spills.empty() ? nullptr : spills[i].get(),
+                                     staging.get(), std::ref(manifest), plan.get(), std::ref(metrics[i])));
+  }
+  std::vector<std::shared_ptr<std::thread> > writers(spills.empty() ? num_threads : 0);
+  for (size_t i = 0; i < writers.size(); ++i) {
+    writers[i].reset(new std::thread(add_leftover_associations, std::cref(pt), std::ref(leftovers),
+                                     staging.get(), write_manifest ? &manifest : nullptr, journal.get(),
+                                     std::ref(metrics[num_threads + i])));
   }
 
   //wait for it to finish
   for (auto& thread : threads)
     thread->join();
+  LOG_INFO("Finished local associations, writing whatever is left");
+  try {
+    if (spills.size())
+      add_spilled_associations(pt, spills, write_manifest ? &manifest : nullptr, metrics[num_threads]);
+  }
+  catch (const std::exception& e) {
+    LOG_ERROR(e.what());
+    return EXIT_FAILURE;
+  }
+  leftovers.close();
+  for (auto& writer : writers)
+    writer->join();
+  //every graph tile we wrote to was hashed before we did, so the manifest is complete
+  auto manifest_file = (bfs::path(hierarchy.tile_dir()) / kManifestName).string();
+  if (write_manifest)
+    manifest.save(manifest_file);
+  else
+    bfs::remove(manifest_file);
+
+  //the run is complete so there is nothing left to resume
+  journal.reset();
+  bfs::remove(journal_file);
+  if (staging)
+    staging->clear();
+
+  //say where the time went
+  metrics_t total;
+  for (const auto& thread_metrics : metrics)
+    total.merge(thread_metrics);
+  for (size_t i = 0; i < total.outcomes.size(); ++i) {
+    const auto& result = total.outcomes[i];
+    if (result.count)
+      LOG_INFO(std::string(outcome_names[i]) + ": " + std::to_string(result.count) + " segments, " +
+               std::to_string(result.total / result.count) + "us average");
+  }
+  LOG_INFO("Loading " + std::to_string(total.load.total / 1000000) + "s, searching " +
+           std::to_string(total.search.total / 1000000) + "s, matching " + std::to_string(total.match.total / 1000000) +
+           "s, writing " + std::to_string((total.write.total + total.leftovers.total) / 1000000) + "s across all threads, " +
+           std::to_string(total.cache_clears) + " graph tile cache clears");
+  auto metrics_file = (bfs::path(hierarchy.tile_dir()) / kMetricsName).string();
+  bpt::write_json(metrics_file, total.to_ptree());
+  LOG_INFO("Wrote metrics to " + metrics_file);
   LOG_INFO("Finished");
 
   return EXIT_SUCCESS;
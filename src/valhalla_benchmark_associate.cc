@@ -0,0 +1,195 @@
+#include "config.h"
+#include "segment.pb.h"
+#include "tile.pb.h"
+#include "edge_association.h"
+
+#include <valhalla/midgard/logging.h>
+
+#include <boost/program_options.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace vb = valhalla::baldr;
+namespace bpo = boost::program_options;
+namespace bpt = boost::property_tree;
+
+using association::edge_association;
+using association::metrics_t;
+using association::outcome;
+using association::outcome_names;
+using association::tile_batch_t;
+using association::work_queue;
+using association::take_batch;
+
+namespace {
+
+//match the osmlr tiles with fresh caches, as a real run would start, but without writing anything.
+//the batches are handed out and stolen exactly as valhalla_associate_segments does it
+void associate(const bpt::ptree& pt, std::vector<work_queue>& queues, size_t self, metrics_t& metrics) {
+  edge_association e(pt, metrics);
+  tile_batch_t batch;
+  while (take_batch(queues, self, batch)) {
+    for (const auto& osmlr_tile : batch) {
+      e.add_tile(osmlr_tile, false);
+      e.take_leftovers();
+      e.take_partials();
+    }
+  }
+}
+
+uint64_t percentile(std::vector<uint64_t>& samples, double p) {
+  if (samples.empty())
+    return 0;
+  auto nth = samples.begin() + std::min(samples.size() - 1, size_t(p * samples.size()));
+  std::nth_element(samples.begin(), nth, samples.end());
+  return *nth;
+}
+
+bpt::ptree run(bpt::ptree pt, const std::vector<std::string>& osmlr_tiles, unsigned int num_threads, bool by_area) {
+  //split the cache the same way valhalla_associate_segments does
+  auto max_cache_size = pt.get<size_t>("mjolnir.max_cache_size", 1073741824);
+  pt.put("mjolnir.max_cache_size", max_cache_size / num_threads);
+
+  vb::TileHierarchy hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
+  std::vector<work_queue> queues(num_threads);
+  association::deal_batches(association::make_batches(hierarchy, osmlr_tiles, num_threads, by_area), queues);
+
+  std::vector<metrics_t> metrics(num_threads);
+  for (auto& thread_metrics : metrics)
+    thread_metrics.sampling = true;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; ++i)
+    threads.emplace_back(associate, std::cref(pt), std::ref(queues), i, std::ref(metrics[i]));
+  for (auto& thread : threads)
+    thread.join();
+  auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  metrics_t total;
+  for (const auto& thread_metrics : metrics)
+    total.merge(thread_metrics);
+  uint64_t segments = total.samples.size(), matched = 0;
+  bpt::ptree outcomes;
+  for (size_t i = 0; i < total.outcomes.size(); ++i) {
+    outcomes.put(outcome_names[i], total.outcomes[i].count);
+    //the first few outcomes are the ways a segment can match
+    if (i <= size_t(outcome::kRouted))
+      matched += total.outcomes[i].count;
+  }
+
+  bpt::ptree result;
+  result.put("threads", num_threads);
+  result.put("ordering", by_area ? "area" : "level");
+  result.put("seconds", seconds);
+  result.put("segments", segments);
+  result.put("segments_per_second", segments / seconds);
+  result.put("match_rate", segments ? double(matched) / segments : 0.0);
+  result.put("p50_us", percentile(total.samples, 0.5));
+  result.put("p99_us", percentile(total.samples, 0.99));
+  result.put("cache_clears", total.cache_clears);
+  result.put("cache_clears_per_1000_segments", segments ? 1000.0 * total.cache_clears / segments : 0.0);
+  result.add_child("outcomes", outcomes);
+  result.add_child("stages", total.to_ptree().get_child("stages"));
+  return result;
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::string config, output;
+  std::vector<std::string> osmlr_tiles;
+  unsigned int max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+  bpo::options_description options("valhalla_benchmark_associate " VERSION "\n"
+                                   "\n"
+                                   " Usage: valhalla_benchmark_associate [options] <osmlr_tile> ...\n"
+                                   "\n"
+                                   "valhalla_benchmark_associate matches the segments of a sample of osmlr tiles "
+                                   "against the graph in the config, the same way valhalla_associate_segments does "
+                                   "but without writing anything, once with each number of threads from 1 up to "
+                                   "--concurrency. The osmlr tiles are batched and handed out to the threads the same "
+                                   "way too, each number of threads is run once with the osmlr tiles ordered by area and "
+                                   "once with them ordered level by level. Throughput, per segment timings, match rate "
+                                   "and how often the graph tile caches filled up and had to be cleared are written "
+                                   "out as json for each run."
+                                   "\n"
+                                   "\n");
+
+  options.add_options()
+    ("help,h", "Print this help message.")
+    ("version,v", "Print the version of this software.")
+    ("config,c", bpo::value<std::string>(&config), "Valhalla configuration file [required]")
+    ("concurrency,j", bpo::value<unsigned int>(&max_threads), "The most threads to run with [default=all cores].")
+    ("output,o", bpo::value<std::string>(&output), "Where to write the json [default=stdout].")
+    // positional arguments
+    ("osmlr_tiles", bpo::value<std::vector<std::string> >(&osmlr_tiles)->multitoken());
+
+  bpo::positional_options_description pos_options;
+  pos_options.add("osmlr_tiles", -1);
+  bpo::variables_map vm;
+  try {
+    bpo::store(bpo::command_line_parser(argc, argv).options(options).positional(pos_options).run(), vm);
+    bpo::notify(vm);
+  }
+  catch (std::exception &e) {
+    std::cerr << "Unable to parse command line options because: " << e.what()
+              << "\n" << "This is a bug, please report it at " PACKAGE_BUGREPORT
+              << "\n";
+    return EXIT_FAILURE;
+  }
+
+  if (vm.count("help") || !vm.count("config") || osmlr_tiles.empty()) {
+    std::cout << options << "\n";
+    return EXIT_SUCCESS;
+  }
+
+  if (vm.count("version")) {
+    std::cout << "valhalla_benchmark_associate " << VERSION << "\n";
+    return EXIT_SUCCESS;
+  }
+  max_threads = std::max(max_threads, 1u);
+
+  //configure logging
+  valhalla::midgard::logging::Configure({{"type","std_err"},{"color","true"}});
+
+  //parse the config
+  bpt::ptree pt;
+  bpt::read_json(config.c_str(), pt);
+
+  //the same sample with more and more threads, and both ways of ordering it
+  bpt::ptree runs;
+  try {
+    for (unsigned int num_threads = 1; num_threads <= max_threads; ++num_threads) {
+      for (bool by_area : {true, false}) {
+        LOG_INFO("Associating " + std::to_string(osmlr_tiles.size()) + " osmlr tiles ordered by " +
+                 (by_area ? "area" : "level") + " with " + std::to_string(num_threads) + " threads");
+        auto result = run(pt, osmlr_tiles, num_threads, by_area);
+        LOG_INFO(std::to_string(result.get<double>("segments_per_second")) + " segments per second, " +
+                 std::to_string(result.get<double>("cache_clears_per_1000_segments")) +
+                 " cache clears per 1000 segments");
+        runs.push_back(std::make_pair("", result));
+      }
+    }
+  }
+  catch (const std::exception& e) {
+    LOG_ERROR(e.what());
+    return EXIT_FAILURE;
+  }
+
+  bpt::ptree report;
+  report.put("osmlr_tiles", osmlr_tiles.size());
+  report.add_child("runs", runs);
+  if (output.empty())
+    bpt::write_json(std::cout, report);
+  else
+    bpt::write_json(output, report);
+
+  return EXIT_SUCCESS;
+}
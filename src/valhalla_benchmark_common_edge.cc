@@ -0,0 +1,193 @@
+#include "config.h"
+#include "segment.pb.h"
+#include "tile.pb.h"
+#include "segment_association.h"
+
+#include <valhalla/baldr/graphreader.h>
+#include <valhalla/midgard/logging.h>
+
+#include <boost/program_options.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <chrono>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace vb = valhalla::baldr;
+namespace bpo = boost::program_options;
+namespace bpt = boost::property_tree;
+namespace pbf = opentraffic::osmlr;
+
+using association::node_ref;
+
+namespace {
+
+//the nodes near both ends of a segment, which is all finding a common edge needs
+struct job_t {
+  std::vector<node_ref> origins, dests;
+};
+
+//how finding common edges used to work, a fresh hash set per call and a tile
+//lookup per destination edge, so we have something to compare against
+vb::GraphId reference_common_edge(vb::GraphReader& reader, const std::vector<node_ref>& origins,
+                                  const std::vector<node_ref>& dests) {
+  std::unordered_set<vb::GraphId> start_edges;
+  for (const auto& node : origins) {
+    const auto base = node.id.Tile_Base();
+    for (uint32_t i = 0; i < node.edge_count; ++i)
+      start_edges.insert(base + uint64_t(node.edge_index + i));
+  }
+  if (start_edges.empty())
+    return vb::GraphId();
+
+  vb::GraphId found;
+  for (const auto& node : dests) {
+    const auto* tile = reader.GetGraphTile(node.id);
+    for (uint32_t i = 0; i < node.edge_count; ++i) {
+      const auto* edge = tile->directededge(node.edge_index + i);
+      const auto* opp_tile = reader.GetGraphTile(edge->endnode());
+      auto opp_id = opp_tile->GetOpposingEdgeId(edge);
+      if (start_edges.find(opp_id) != start_edges.end()) {
+        if (found)
+          return vb::GraphId();
+        found = opp_id;
+      }
+    }
+  }
+  return found;
+}
+
+template <class function_t>
+double time_jobs(const std::vector<job_t>& jobs, size_t iterations, std::vector<vb::GraphId>& results,
+                 function_t function) {
+  results.resize(jobs.size());
+  auto start = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < iterations; ++i)
+    for (size_t j = 0; j < jobs.size(); ++j)
+      results[j] = function(jobs[j]);
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / (iterations * jobs.size());
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::string config;
+  std::vector<std::string> osmlr_tiles;
+  size_t iterations = 10;
+
+  bpo::options_description options("valhalla_benchmark_common_edge " VERSION "\n"
+                                   "\n"
+                                   " Usage: valhalla_benchmark_common_edge [options] <osmlr_tile> ...\n"
+                                   "\n"
+                                   "valhalla_benchmark_common_edge replays the segments of real osmlr tiles "
+                                   "through the common edge check that valhalla_associate_segments does before "
+                                   "any routing, and compares it to the way it used to be done."
+                                   "\n"
+                                   "\n");
+
+  options.add_options()
+    ("help,h", "Print this help message.")
+    ("version,v", "Print the version of this software.")
+    ("config,c", bpo::value<std::string>(&config), "Valhalla configuration file [required]")
+    ("iterations,i", bpo::value<size_t>(&iterations), "How many times to replay each segment [default=10].")
+    // positional arguments
+    ("osmlr_tiles", bpo::value<std::vector<std::string> >(&osmlr_tiles)->multitoken());
+
+  bpo::positional_options_description pos_options;
+  pos_options.add("osmlr_tiles", -1);
+  bpo::variables_map vm;
+  try {
+    bpo::store(bpo::command_line_parser(argc, argv).options(options).positional(pos_options).run(), vm);
+    bpo::notify(vm);
+  }
+  catch (std::exception &e) {
+    std::cerr << "Unable to parse command line options because: " << e.what()
+              << "\n" << "This is a bug, please report it at " PACKAGE_BUGREPORT
+              << "\n";
+    return EXIT_FAILURE;
+  }
+
+  if (vm.count("help") || !vm.count("config") || osmlr_tiles.empty()) {
+    std::cout << options << "\n";
+    return EXIT_SUCCESS;
+  }
+
+  if (vm.count("version")) {
+    std::cout << "valhalla_benchmark_common_edge " << VERSION << "\n";
+    return EXIT_SUCCESS;
+  }
+  iterations = std::max(iterations, static_cast<size_t>(1));
+
+  //configure logging
+  valhalla::midgard::logging::Configure({{"type","std_err"},{"color","true"}});
+
+  //parse the config
+  bpt::ptree pt;
+  bpt::read_json(config.c_str(), pt);
+  vb::GraphReader reader(pt.get_child("mjolnir"));
+
+  //find the nodes at the ends of every segment up front, so that all the tiles are in the cache
+  //before we start timing and we only measure the check itself
+  LOG_INFO("Loading segments");
+  association::node_finder nodes;
+  std::vector<job_t> jobs;
+  pbf::Tile::Entry entry;
+  try {
+    for (const auto& file_name : osmlr_tiles) {
+      association::osmlr_reader tile(file_name);
+      while (tile.next(entry)) {
+        if (entry.has_marker() || entry.segment().lrps_size() < 2)
+          continue;
+        const auto& segment = entry.segment();
+        job_t job;
+        job.origins = nodes.within(reader, 10.0, association::coord_for_lrp(segment.lrps(0)));
+        job.dests = nodes.within(reader, 10.0, association::coord_for_lrp(segment.lrps(segment.lrps_size() - 1)));
+        if (job.origins.size() && job.dests.size())
+          jobs.emplace_back(std::move(job));
+      }
+    }
+  }
+  catch (const std::exception& e) {
+    LOG_ERROR(e.what());
+    return EXIT_FAILURE;
+  }
+  if (jobs.empty()) {
+    LOG_ERROR("No segments with nodes at both ends to replay");
+    return EXIT_FAILURE;
+  }
+  LOG_INFO("Replaying " + std::to_string(jobs.size()) + " segments " + std::to_string(iterations) + " times");
+
+  //the old way
+  std::vector<vb::GraphId> expected;
+  auto reference_ns = time_jobs(jobs, iterations, expected, [&reader](const job_t& job) {
+    return reference_common_edge(reader, job.origins, job.dests);
+  });
+
+  //the new way
+  std::vector<vb::GraphId> found;
+  association::common_edge_finder finder;
+  auto finder_ns = time_jobs(jobs, iterations, found, [&reader, &finder](const job_t& job) {
+    return finder.find(reader, job.origins, job.dests);
+  });
+
+  //they should agree
+  size_t common = 0, mismatches = 0;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    common += found[i].Is_Valid();
+    mismatches += found[i] != expected[i];
+  }
+
+  LOG_INFO("Segments with a common edge: " + std::to_string(common) + " of " + std::to_string(jobs.size()));
+  LOG_INFO("Hash set: " + std::to_string(reference_ns) + "ns per segment");
+  LOG_INFO("Common edge finder: " + std::to_string(finder_ns) + "ns per segment");
+  LOG_INFO("Speedup: " + std::to_string(reference_ns / finder_ns) + "x");
+  if (mismatches) {
+    LOG_ERROR(std::to_string(mismatches) + " segments got a different common edge");
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
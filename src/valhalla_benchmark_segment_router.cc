@@ -0,0 +1,306 @@
+#include "config.h"
+#include "segment.pb.h"
+#include "tile.pb.h"
+#include "segment_association.h"
+
+#include <valhalla/baldr/graphreader.h>
+#include <valhalla/loki/search.h>
+#include <valhalla/midgard/logging.h>
+#include <valhalla/sif/dynamiccost.h>
+#include <valhalla/thor/astar.h>
+
+#include <boost/program_options.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace vb = valhalla::baldr;
+namespace vl = valhalla::loki;
+namespace vs = valhalla::sif;
+namespace vt = valhalla::thor;
+namespace bpo = boost::program_options;
+namespace bpt = boost::property_tree;
+namespace pbf = opentraffic::osmlr;
+
+using association::check_access;
+using association::distance_only;
+using association::vehicular;
+
+namespace {
+
+//the same costing the segment router uses, but behind the virtual interface thor wants
+class DistanceOnlyCost : public vs::DynamicCost {
+public:
+  DistanceOnlyCost(vs::TravelMode travel_mode);
+  virtual ~DistanceOnlyCost();
+  uint32_t access_mode() const;
+  bool Allowed(const vb::DirectedEdge* edge,
+               const vs::EdgeLabel& pred,
+               const vb::GraphTile*& tile,
+               const vb::GraphId& edgeid) const;
+  bool AllowedReverse(const vb::DirectedEdge* edge,
+                      const vs::EdgeLabel& pred,
+                      const vb::DirectedEdge* opp_edge,
+                      const vb::GraphTile*& tile,
+                      const vb::GraphId& edgeid) const;
+  bool Allowed(const vb::NodeInfo* node) const;
+  vs::Cost EdgeCost(const vb::DirectedEdge* edge) const;
+  const vs::EdgeFilter GetEdgeFilter() const;
+  const vs::NodeFilter GetNodeFilter() const;
+  float AStarCostFactor() const;
+};
+
+DistanceOnlyCost::DistanceOnlyCost(vs::TravelMode travel_mode)
+  : DynamicCost(bpt::ptree(), travel_mode) {
+}
+
+DistanceOnlyCost::~DistanceOnlyCost() {
+}
+
+uint32_t DistanceOnlyCost::access_mode() const {
+  return vehicular;
+}
+
+bool DistanceOnlyCost::Allowed(const vb::DirectedEdge* edge,
+                               const vs::EdgeLabel&,
+                               const vb::GraphTile*&,
+                               const vb::GraphId&) const {
+  return check_access(edge);
+}
+
+bool DistanceOnlyCost::AllowedReverse(const vb::DirectedEdge* edge,
+                                      const vs::EdgeLabel&,
+                                      const vb::DirectedEdge*,
+                                      const vb::GraphTile*&,
+                                      const vb::GraphId&) const {
+  return check_access(edge);
+}
+
+bool DistanceOnlyCost::Allowed(const vb::NodeInfo*) const {
+  return true;
+}
+
+vs::Cost DistanceOnlyCost::EdgeCost(const vb::DirectedEdge* edge) const {
+  float edge_len(edge->length());
+  return {edge_len, edge_len};
+}
+
+const vs::EdgeFilter DistanceOnlyCost::GetEdgeFilter() const {
+  return [](const vb::DirectedEdge *edge) -> float {
+    return check_access(edge) ? 1.0f : 0.0f;
+  };
+}
+
+const vs::NodeFilter DistanceOnlyCost::GetNodeFilter() const {
+  return [](const vb::NodeInfo *) -> bool {
+    return false;
+  };
+}
+
+float DistanceOnlyCost::AStarCostFactor() const {
+  return 1.0f;
+}
+
+//the segment router's own costing behind a virtual interface, so that with the same bound on the
+//search the only difference from the inlined router is a virtual call per question
+class virtual_cost {
+public:
+  virtual ~virtual_cost() {}
+  virtual bool allowed(const vb::DirectedEdge* edge) const = 0;
+  virtual float cost(const vb::DirectedEdge* edge) const = 0;
+  virtual float heuristic(float meters) const = 0;
+};
+
+class virtual_distance_only : public virtual_cost {
+public:
+  bool allowed(const vb::DirectedEdge* edge) const override { return distance_only().allowed(edge); }
+  float cost(const vb::DirectedEdge* edge) const override { return distance_only().cost(edge); }
+  float heuristic(float meters) const override { return distance_only().heuristic(meters); }
+};
+
+struct virtual_policy {
+  bool allowed(const vb::DirectedEdge* edge) const { return cost_->allowed(edge); }
+  float cost(const vb::DirectedEdge* edge) const { return cost_->cost(edge); }
+  float heuristic(float meters) const { return cost_->heuristic(meters); }
+  std::shared_ptr<const virtual_cost> cost_;
+};
+
+//one route between consecutive lrps of a segment
+struct job_t {
+  vb::PathLocation origin, dest;
+  float max_length;
+};
+
+//all the lrp pairs of the segments in an osmlr tile, searched the same way associate segments does
+void add_jobs(vb::GraphReader& reader, const std::string& file_name, std::vector<job_t>& jobs) {
+  association::osmlr_reader tile(file_name);
+  auto level = vb::GraphTile::GetTileId(file_name).level();
+
+  auto edge_filter = [level](const vb::DirectedEdge* edge) -> float {
+    return association::search_filter(edge, level);
+  };
+
+  std::vector<pbf::Tile::Entry> entries;
+  while (auto count = tile.next(entries, association::kEntriesPerSearch)) {
+    auto results = vl::Search(association::locations_for_entries(entries, count), reader, edge_filter,
+                              vl::PassThroughNodeFilter);
+    for (size_t e = 0; e < count; ++e) {
+      const auto& entry = entries[e];
+      if (entry.has_marker() || entry.segment().lrps_size() < 2)
+        continue;
+      const auto& segment = entry.segment();
+      for (int i = 0; i < segment.lrps_size() - 1; ++i) {
+        auto origin = results.find(i == 0 ? vb::Location(association::coord_for_lrp(segment.lrps(0))) :
+                                            association::location_for_lrp(segment.lrps(i)));
+        auto dest = results.find(association::location_for_lrp(segment.lrps(i + 1)));
+        if (origin == results.end() || dest == results.end() || origin->second.edges.empty() || dest->second.edges.empty())
+          continue;
+        auto max_length = segment.lrps(i).length() * association::kMaxRouteFactor + association::kRouteSlack;
+        jobs.emplace_back(job_t{origin->second, dest->second, max_length});
+      }
+    }
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::string config;
+  std::vector<std::string> osmlr_tiles;
+
+  bpo::options_description options("valhalla_benchmark_segment_router " VERSION "\n"
+                                   "\n"
+                                   " Usage: valhalla_benchmark_segment_router [options] <osmlr_tile> ...\n"
+                                   "\n"
+                                   "valhalla_benchmark_segment_router routes between the lrps of the segments in "
+                                   "real osmlr tiles, once with thor's AStarPathAlgorithm and a virtual distance only "
+                                   "costing and then twice with the bounded segment router valhalla_associate_segments "
+                                   "uses, asking a virtual costing about every edge and with the costing inlined. "
+                                   "It reports how often the router finds the same path as thor."
+                                   "\n"
+                                   "\n");
+
+  options.add_options()
+    ("help,h", "Print this help message.")
+    ("version,v", "Print the version of this software.")
+    ("config,c", bpo::value<std::string>(&config), "Valhalla configuration file [required]")
+    // positional arguments
+    ("osmlr_tiles", bpo::value<std::vector<std::string> >(&osmlr_tiles)->multitoken());
+
+  bpo::positional_options_description pos_options;
+  pos_options.add("osmlr_tiles", -1);
+  bpo::variables_map vm;
+  try {
+    bpo::store(bpo::command_line_parser(argc, argv).options(options).positional(pos_options).run(), vm);
+    bpo::notify(vm);
+  }
+  catch (std::exception &e) {
+    std::cerr << "Unable to parse command line options because: " << e.what()
+              << "\n" << "This is a bug, please report it at " PACKAGE_BUGREPORT
+              << "\n";
+    return EXIT_FAILURE;
+  }
+
+  if (vm.count("help") || !vm.count("config") || osmlr_tiles.empty()) {
+    std::cout << options << "\n";
+    return EXIT_SUCCESS;
+  }
+
+  if (vm.count("version")) {
+    std::cout << "valhalla_benchmark_segment_router " << VERSION << "\n";
+    return EXIT_SUCCESS;
+  }
+
+  //configure logging
+  valhalla::midgard::logging::Configure({{"type","std_err"},{"color","true"}});
+
+  //parse the config
+  bpt::ptree pt;
+  bpt::read_json(config.c_str(), pt);
+  vb::GraphReader reader(pt.get_child("mjolnir"));
+
+  //search all the locations up front so that we only time the routing
+  LOG_INFO("Loading segments");
+  std::vector<job_t> jobs;
+  try {
+    for (const auto& file_name : osmlr_tiles)
+      add_jobs(reader, file_name, jobs);
+  }
+  catch (const std::exception& e) {
+    LOG_ERROR(e.what());
+    return EXIT_FAILURE;
+  }
+  if (jobs.empty()) {
+    LOG_ERROR("No lrp pairs to route between");
+    return EXIT_FAILURE;
+  }
+  LOG_INFO("Routing " + std::to_string(jobs.size()) + " lrp pairs");
+
+  //what associate segments used to do, thor's path algorithm behind the virtual costing. it doesnt
+  //know about the length limit
+  vs::TravelMode travel_mode = vs::TravelMode::kDrive;
+  std::shared_ptr<vs::DynamicCost> costing(new DistanceOnlyCost(travel_mode));
+  vt::AStarPathAlgorithm astar;
+  std::vector<std::vector<vb::GraphId> > expected(jobs.size());
+  size_t astar_found = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    auto origin = jobs[i].origin;
+    auto dest = jobs[i].dest;
+    astar.Clear();
+    auto path = astar.GetBestPath(origin, dest, reader, &costing, travel_mode);
+    for (const auto& info : path)
+      expected[i].push_back(info.edgeid);
+    astar_found += !path.empty();
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  auto astar_us = std::chrono::duration<double, std::micro>(end - start).count() / jobs.size();
+
+  //the bounded segment router still asking a virtual costing, this is what the bound alone is worth
+  association::segment_router<virtual_policy> virtual_router(virtual_policy{std::make_shared<virtual_distance_only>()});
+  std::vector<vb::GraphId> path;
+  size_t virtual_found = 0;
+  float length;
+  start = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < jobs.size(); ++i)
+    virtual_found += virtual_router.route(reader, jobs[i].origin, jobs[i].dest, jobs[i].max_length, path, length);
+  end = std::chrono::high_resolution_clock::now();
+  auto virtual_us = std::chrono::duration<double, std::micro>(end - start).count() / jobs.size();
+
+  //and with everything inlined, which is what associate segments uses
+  association::segment_router<> router;
+  std::vector<std::vector<vb::GraphId> > found(jobs.size());
+  size_t router_found = 0;
+  start = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < jobs.size(); ++i)
+    router_found += router.route(reader, jobs[i].origin, jobs[i].dest, jobs[i].max_length, found[i], length);
+  end = std::chrono::high_resolution_clock::now();
+  auto router_us = std::chrono::duration<double, std::micro>(end - start).count() / jobs.size();
+
+  //where both found a path it should be the same one, ties aside. thor can find paths past the
+  //bound which the router gives up on, those are counted separately
+  size_t both = 0, same = 0, astar_only = 0;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    if (expected[i].empty() || found[i].empty()) {
+      astar_only += found[i].empty() && !expected[i].empty();
+      continue;
+    }
+    ++both;
+    same += expected[i] == found[i];
+  }
+
+  LOG_INFO("AStarPathAlgorithm: " + std::to_string(astar_us) + "us per route, " + std::to_string(astar_found) + " found");
+  LOG_INFO("Bounded, virtual costing: " + std::to_string(virtual_us) + "us per route, " + std::to_string(virtual_found) + " found");
+  LOG_INFO("Bounded, inlined costing: " + std::to_string(router_us) + "us per route, " + std::to_string(router_found) + " found");
+  LOG_INFO("Speedup from the bound: " + std::to_string(astar_us / virtual_us) + "x");
+  LOG_INFO("Speedup from inlining: " + std::to_string(virtual_us / router_us) + "x");
+  LOG_INFO("Speedup overall: " + std::to_string(astar_us / router_us) + "x");
+  LOG_INFO("Same path as AStarPathAlgorithm: " + std::to_string(same) + " of " + std::to_string(both) + " found by both, " +
+           std::to_string(astar_only) + " only found by AStarPathAlgorithm");
+
+  return EXIT_SUCCESS;
+}
@@ -1,15 +1,30 @@
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
 #include <boost/program_options.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
 #include <valhalla/baldr/graphconstants.h>
 #include <valhalla/baldr/graphreader.h>
+#include <valhalla/baldr/graphtileheader.h>
 #include <valhalla/midgard/logging.h>
-#include <valhalla/midgard/encoded.h>
 
-#include <unordered_map>
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <limits>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdio>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "config.h"
 
@@ -18,28 +33,161 @@ using namespace valhalla::baldr;
 
 namespace bpo = boost::program_options;
 
+//which edges get exported, one bit per use and per road class so checking an edge is a couple of shifts
+struct edge_filter_t {
+  uint64_t uses;
+  uint8_t classes;
+  //the edge has to allow at least one of these in at least one direction, 0 means anything goes
+  uint32_t access;
+  bool operator()(const DirectedEdge* edge) const {
+    return (uses >> static_cast<uint8_t>(edge->use()) & 1) &&
+           (classes >> static_cast<uint8_t>(edge->classification()) & 1) &&
+           (!access || ((edge->forwardaccess() | edge->reverseaccess()) & access));
+  }
+};
+
+//ferries only if you ask for them
+constexpr uint64_t kDefaultUses = ~(static_cast<uint64_t>(1) << static_cast<uint8_t>(Use::kFerry));
+
+//the columns that can come out between the shape and the names
+enum class column_t : uint8_t { kSpeed, kLength, kWayIds, kClass };
+
 //global options instead of passing them around
 std::string column_separator{'\0'};
 std::string row_separator = "\n";
 std::string config;
 bool ferries;
 bool unnamed;
+edge_filter_t filter{kDefaultUses, 0xff, 0};
+std::vector<column_t> columns;
+bool binary;
+bool greedy;
+unsigned int num_threads = std::thread::hardware_concurrency();
 
 namespace {
 
+const std::unordered_map<std::string, Use> kUses{
+  {"road", Use::kRoad}, {"ramp", Use::kRamp}, {"turn_channel", Use::kTurnChannel}, {"track", Use::kTrack},
+  {"driveway", Use::kDriveway}, {"alley", Use::kAlley}, {"parking_aisle", Use::kParkingAisle},
+  {"emergency_access", Use::kEmergencyAccess}, {"drive_through", Use::kDriveThru}, {"culdesac", Use::kCuldesac},
+  {"cycleway", Use::kCycleway}, {"mountain_bike", Use::kMountainBike}, {"sidewalk", Use::kSidewalk},
+  {"footway", Use::kFootway}, {"steps", Use::kSteps}, {"other", Use::kOther}, {"ferry", Use::kFerry},
+  {"rail_ferry", Use::kRailFerry}, {"rail", Use::kRail}, {"bus", Use::kBus},
+  {"rail_connection", Use::kRailConnection}, {"bus_connection", Use::kBusConnection},
+};
+//indexed by road class
+const std::vector<std::string> kRoadClasses{
+  "motorway", "trunk", "primary", "secondary", "tertiary", "unclassified", "residential", "service_other"
+};
+const std::unordered_map<std::string, uint32_t> kAccess{
+  {"auto", kAutoAccess}, {"pedestrian", kPedestrianAccess}, {"bicycle", kBicycleAccess}, {"truck", kTruckAccess},
+  {"emergency", kEmergencyAccess}, {"taxi", kTaxiAccess}, {"bus", kBusAccess}, {"hov", kHOVAccess},
+};
+//indexed by column
+const std::vector<std::string> kColumns{"speed", "length", "way_ids", "class"};
+
+std::vector<std::string> split(const std::string& spec, const char* separators) {
+  std::vector<std::string> parts;
+  if(spec.size())
+    boost::algorithm::split(parts, spec, boost::algorithm::is_any_of(separators));
+  return parts;
+}
+
+//something like use=road,ramp;class=motorway,trunk;access=auto,truck where anything left out isnt filtered on,
+//except that leaving out use still leaves out ferries unless they were asked for with -f
+edge_filter_t parse_filter(const std::string& spec) {
+  edge_filter_t parsed{kDefaultUses, 0xff, 0};
+  for(const auto& clause : split(spec, ";")) {
+    auto key_values = split(clause, "=");
+    if(key_values.size() != 2)
+      throw std::runtime_error("Filter clauses look like key=value,value not " + clause);
+    const auto& key = key_values.front();
+    if(key == "use")
+      parsed.uses = 0;
+    else if(key == "class")
+      parsed.classes = 0;
+    else if(key != "access")
+      throw std::runtime_error("Can only filter on use, class or access not " + key);
+    for(const auto& value : split(key_values.back(), ",")) {
+      if(key == "use") {
+        auto use = kUses.find(value);
+        if(use == kUses.cend())
+          throw std::runtime_error("Unknown use " + value);
+        parsed.uses |= static_cast<uint64_t>(1) << static_cast<uint8_t>(use->second);
+      }
+      else if(key == "class") {
+        auto road_class = std::find(kRoadClasses.cbegin(), kRoadClasses.cend(), value);
+        if(road_class == kRoadClasses.cend())
+          throw std::runtime_error("Unknown road class " + value);
+        parsed.classes |= 1 << (road_class - kRoadClasses.cbegin());
+      }
+      else {
+        auto access = kAccess.find(value);
+        if(access == kAccess.cend())
+          throw std::runtime_error("Unknown access " + value);
+        parsed.access |= access->second;
+      }
+    }
+  }
+  return parsed;
+}
+
+//something like speed,length in the order they should come out
+std::vector<column_t> parse_columns(const std::string& spec) {
+  std::vector<column_t> parsed;
+  for(const auto& name : split(spec, ",")) {
+    auto column = std::find(kColumns.cbegin(), kColumns.cend(), name);
+    if(column == kColumns.cend())
+      throw std::runtime_error("Unknown column " + name);
+    parsed.push_back(static_cast<column_t>(column - kColumns.cbegin()));
+  }
+  return parsed;
+}
+
 //a place we can mark what edges we've seen, even for the planet we should need < 100mb
+//the threads all share it so setting a bit is atomic and tells you whether it was you who set it
 struct bitset_t {
-  bitset_t(size_t size) {bits.resize(std::ceil(size / 64.0));}
-  void set(const uint64_t id) {
-    if (id >= bits.size() * 64) throw std::runtime_error("id out of bounds");
-    bits[id / 64] |= static_cast<uint64_t>(1) << (id % static_cast<uint64_t>(64));
+  bitset_t(size_t size) : count(std::ceil(size / 64.0)), bits(new std::atomic<uint64_t>[count]) {
+    for(size_t i = 0; i < count; ++i)
+      bits[i].store(0, std::memory_order_relaxed);
+  }
+  bool set(const uint64_t id) {
+    if (id >= count * 64) throw std::runtime_error("id out of bounds");
+    auto bit = static_cast<uint64_t>(1) << (id % static_cast<uint64_t>(64));
+    return !(bits[id / 64].fetch_or(bit) & bit);
   }
   bool get(const uint64_t id) const {
-    if (id >= bits.size() * 64) throw std::runtime_error("id out of bounds");
-    return bits[id / 64] & (static_cast<uint64_t>(1) << (id % static_cast<uint64_t>(64)));
+    if (id >= count * 64) throw std::runtime_error("id out of bounds");
+    return bits[id / 64].load(std::memory_order_relaxed) & (static_cast<uint64_t>(1) << (id % static_cast<uint64_t>(64)));
   }
 protected:
-  std::vector<uint64_t> bits;
+  size_t count;
+  std::unique_ptr<std::atomic<uint64_t>[]> bits;
+};
+
+//where each tile's edges start in the global numbering, one array per level indexed by tile id. tiles
+//that dont exist have no edges so they just start where the next one does
+struct tile_index_t {
+  //levels have to be added in order, counts are the edges of the tiles on the level that exist by tile id
+  void add_level(uint8_t level, uint32_t tile_count, const std::vector<std::pair<GraphId, uint32_t> >& counts) {
+    if(offsets.size() <= level)
+      offsets.resize(level + 1);
+    auto& prefix_sums = offsets[level];
+    prefix_sums.resize(tile_count);
+    auto tile = counts.cbegin();
+    for(uint32_t i = 0; i < tile_count; ++i) {
+      prefix_sums[i] = edge_count;
+      if(tile != counts.cend() && tile->first.tileid() == i)
+        edge_count += (tile++)->second;
+    }
+  }
+  //the edge's position in the global numbering
+  uint64_t operator()(const GraphId& edge_id) const {
+    return offsets[edge_id.level()][edge_id.tileid()] + edge_id.id();
+  }
+  uint64_t edge_count = 0;
+protected:
+  std::vector<std::vector<uint64_t> > offsets;
 };
 
 //often we need both the edge id and the directed edge, so lets have something to represent that
@@ -60,7 +208,33 @@ edge_t opposing(GraphReader& reader, const GraphTile* tile, const DirectedEdge*
   return {id, tile->directededge(id)};
 }
 
-edge_t next(const std::unordered_map<GraphId, uint64_t>& tile_set, const bitset_t& edge_set, GraphReader& reader,
+//an edge and its opposing edge are claimed together, whoever gets the lower of the two owns both
+//that way two threads coming at the same road from opposite ends can't both end up with it
+bool claim(const tile_index_t& tile_index, bitset_t& edge_set, const edge_t& edge, const edge_t& opposing_edge) {
+  auto a = tile_index(edge.i);
+  auto b = tile_index(opposing_edge.i);
+  if(!edge_set.set(std::min(a, b)))
+    return false;
+  edge_set.set(std::max(a, b));
+  return true;
+}
+
+//whether a road can carry on along this edge
+bool follow(const GraphTile* tile, const edge_t& candidate, const std::vector<std::string>& names) {
+  //dont need these
+  if(!filter(candidate.e))
+    return false;
+  //TODO: dont skip transition edges but rather follow them to other levels
+  //skip these
+  if(candidate.e->trans_up() || candidate.e->use() == Use::kTransitConnection ||
+     candidate.e->trans_down() || candidate.e->IsTransitLine()) //these should never happen
+    return false;
+  //names have to match
+  auto candidate_names = tile->edgeinfo(candidate.e->edgeinfo_offset()).GetNames();
+  return names.size() == candidate_names.size() && std::equal(names.cbegin(), names.cend(), candidate_names.cbegin());
+}
+
+edge_t next(const tile_index_t& tile_index, bitset_t& edge_set, GraphReader& reader,
             const GraphTile*& tile, const edge_t& edge, const std::vector<std::string>& names) {
   //get the right tile
   if(tile->id() != edge.e->endnode().Tile_Base())
@@ -75,40 +249,572 @@ edge_t next(const std::unordered_map<GraphId, uint64_t>& tile_set, const bitset_
     GraphId id = tile->id();
     id.fields.id = node->edge_index() + i;
     //already used
-    if(edge_set.get(tile_set.find(tile->id())->second + id.id()))
+    if(edge_set.get(tile_index(id)))
       continue;
     edge_t candidate{id, tile->directededge(id)};
-    //dont need these
-    if(!ferries && candidate.e->use() == Use::kFerry)
-      continue;
-    //TODO: dont skip transition edges but rather follow them to other levels
-    //skip these
-    if(candidate.e->trans_up() || candidate.e->use() == Use::kTransitConnection ||
-       candidate.e->trans_down() || candidate.e->IsTransitLine()) //these should never happen
+    if(!follow(tile, candidate, names))
       continue;
-    //names have to match
-    auto candidate_names = tile->edgeinfo(candidate.e->edgeinfo_offset()).GetNames();
-    if(names.size() == candidate_names.size() && std::equal(names.cbegin(), names.cend(), candidate_names.cbegin()))
+    //another thread might have beaten us to it since we checked
+    if(claim(tile_index, edge_set, candidate, opposing(reader, tile, candidate)))
       return candidate;
   }
 
   return {};
 }
 
-void extend(GraphReader& reader, const GraphTile*& tile, const edge_t& edge, std::list<PointLL>& shape) {
-  //get the shape
-  if(edge.i.Tile_Base() != tile->id())
-    tile = reader.GetGraphTile(edge.i);
-  //get the shape
-  auto info = tile->edgeinfo(edge.e->edgeinfo_offset());
-  auto more = valhalla::midgard::decode7<std::list<PointLL> >(info.encoded_shape());
-  //this shape runs the other way
-  if(!edge.e->forward())
-    more.reverse();
-  //connecting another shape we dont want dups where they meet
-  if(shape.size())
-    more.pop_front();
-  shape.splice(shape.end(), more);
+//a stretch of road between two nodes, both of its directed edges. only ids are kept because a big component
+//can outgrow the reader's cache and the tiles the edges live in may be gone by the time we're done with it
+struct road_t {
+  GraphId forward, backward;
+  GraphId begin, end;
+  uint32_t length;
+};
+
+//starting from a road we've claimed, claim every road connected to it by the same names. threads race each
+//other for edges so each like named component ends up belonging to one thread which then works on it alone
+std::vector<road_t> component(const tile_index_t& tile_index, bitset_t& edge_set, GraphReader& reader,
+                              const edge_t& edge, const edge_t& opposing_edge, const std::vector<std::string>& names,
+                              std::atomic<uint64_t>& set) {
+  std::vector<road_t> roads{{edge, opposing_edge, opposing_edge.e->endnode(), edge.e->endnode(), edge.e->length()}};
+  std::deque<GraphId> nodes{roads.front().begin, roads.front().end};
+  std::unordered_set<GraphId> visited(nodes.cbegin(), nodes.cend());
+  while(nodes.size()) {
+    auto node_id = nodes.front();
+    nodes.pop_front();
+    //a long road crosses a lot of tiles, we dont need to hang on to the ones we're done with
+    if(reader.OverCommitted())
+      reader.Clear();
+    const auto* tile = reader.GetGraphTile(node_id);
+    const auto* node = tile->node(node_id);
+    for(uint32_t i = 0; i < node->edge_count(); ++i) {
+      GraphId id = tile->id();
+      id.fields.id = node->edge_index() + i;
+      if(edge_set.get(tile_index(id)))
+        continue;
+      edge_t candidate{id, tile->directededge(id)};
+      if(candidate.e->shortcut() || !follow(tile, candidate, names))
+        continue;
+      auto other = opposing(reader, tile, candidate);
+      if(!claim(tile_index, edge_set, candidate, other))
+        continue;
+      set += 2;
+      roads.push_back({candidate, other, node_id, candidate.e->endnode(), candidate.e->length()});
+      if(visited.insert(candidate.e->endnode()).second)
+        nodes.push_back(candidate.e->endnode());
+    }
+  }
+  return roads;
+}
+
+//how far every node is from the start along the roads
+std::vector<double> distances(const std::vector<std::vector<std::pair<uint32_t, uint32_t> > >& adjacency,
+                              uint32_t start) {
+  std::vector<double> distance(adjacency.size(), std::numeric_limits<double>::max());
+  using label_t = std::pair<double, uint32_t>;
+  std::priority_queue<label_t, std::vector<label_t>, std::greater<label_t> > queue;
+  distance[start] = 0;
+  queue.emplace(0, start);
+  while(queue.size()) {
+    auto label = queue.top();
+    queue.pop();
+    if(label.first > distance[label.second])
+      continue;
+    for(const auto& neighbour : adjacency[label.second]) {
+      auto d = label.first + neighbour.second;
+      if(d < distance[neighbour.first]) {
+        distance[neighbour.first] = d;
+        queue.emplace(d, neighbour.first);
+      }
+    }
+  }
+  return distance;
+}
+
+//cut a like named component up into as few and as long linestrings as we can. finding the longest paths in
+//a general graph is NP-Hard but in a DAG it's easy, so we make the component into one. the nodes are ordered
+//by how far they are along the roads from one end of the component, found by going as far as we can from
+//anywhere and then as far as we can from there, and every road is pointed from its nearer node to its further
+//one. a strict order of the nodes means there can't be any cycles and a long road tends to point the same way
+//all along. one pass backwards through that order tells each node which of its roads leads furthest, then one
+//pass forwards starts a linestring at each road nobody has used yet and keeps taking the furthest leading road
+//left at every node it comes to. every road is looked at a constant number of times besides the sorting
+std::vector<std::list<GraphId> > chains(const std::vector<road_t>& roads) {
+  //number the nodes and hook up the roads between them
+  std::unordered_map<GraphId, uint32_t> index;
+  std::vector<std::pair<uint32_t, uint32_t> > ends;
+  for(const auto& road : roads) {
+    auto begin = index.emplace(road.begin, index.size()).first->second;
+    auto end = index.emplace(road.end, index.size()).first->second;
+    ends.emplace_back(begin, end);
+  }
+  std::vector<std::vector<std::pair<uint32_t, uint32_t> > > adjacency(index.size());
+  for(size_t r = 0; r < roads.size(); ++r) {
+    adjacency[ends[r].first].emplace_back(ends[r].second, roads[r].length);
+    adjacency[ends[r].second].emplace_back(ends[r].first, roads[r].length);
+  }
+
+  //order the nodes from one end of the component to the other
+  auto distance = distances(adjacency, 0);
+  auto far = std::max_element(distance.cbegin(), distance.cend()) - distance.cbegin();
+  auto rank = distances(adjacency, far);
+  std::vector<uint32_t> order(index.size());
+  for(uint32_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  auto before = [&rank](uint32_t a, uint32_t b) { return rank[a] < rank[b] || (rank[a] == rank[b] && a < b); };
+  std::sort(order.begin(), order.end(), before);
+
+  //point the roads the same way
+  auto from = [&](uint32_t r) { return before(ends[r].first, ends[r].second) ? ends[r].first : ends[r].second; };
+  auto to = [&](uint32_t r) { return before(ends[r].first, ends[r].second) ? ends[r].second : ends[r].first; };
+  std::vector<std::vector<uint32_t> > outbound(index.size());
+  for(size_t r = 0; r < roads.size(); ++r)
+    outbound[from(r)].push_back(r);
+
+  //how far we can go from each node, working back from the far end, and each node's roads best first
+  std::vector<double> longest(index.size(), 0);
+  for(auto node = order.crbegin(); node != order.crend(); ++node) {
+    auto& out = outbound[*node];
+    for(auto r : out)
+      longest[*node] = std::max(longest[*node], roads[r].length + longest[to(r)]);
+    std::sort(out.begin(), out.end(), [&](uint32_t a, uint32_t b) {
+      return roads[a].length + longest[to(a)] > roads[b].length + longest[to(b)];
+    });
+  }
+
+  //walk from the near end, every road not yet used starts a linestring which carries on along the best road
+  //left at each node. used roads are skipped for good so each node's list is only ever looked through once
+  std::vector<bool> used(roads.size(), false);
+  std::vector<size_t> cursor(index.size(), 0);
+  auto take = [&](uint32_t node) {
+    auto& out = outbound[node];
+    while(cursor[node] < out.size() && used[out[cursor[node]]])
+      ++cursor[node];
+    return cursor[node] < out.size() ? out[cursor[node]++] : std::numeric_limits<uint32_t>::max();
+  };
+  std::vector<std::list<GraphId> > paths;
+  for(auto start : order) {
+    for(auto r = take(start); r != std::numeric_limits<uint32_t>::max(); r = take(start)) {
+      std::list<GraphId> path;
+      for(; r != std::numeric_limits<uint32_t>::max(); r = take(to(r))) {
+        used[r] = true;
+        path.push_back(ends[r].first == from(r) ? roads[r].forward : roads[r].backward);
+      }
+      paths.emplace_back(std::move(path));
+    }
+  }
+  return paths;
+}
+
+//the shape of a path pieced together from its edges' encoded shapes. the points stay in the integer 1e-6
+//degrees they are stored in so nothing is lost going back and forth through floats, and the buffers
+//are reused from one path to the next
+struct shape_t {
+  void clear() {
+    points.clear();
+  }
+  //the tile has to be the edge's, hands back the edge info in case the caller wants anything else from it
+  EdgeInfo extend(const GraphTile* tile, const edge_t& edge) {
+    //get the shape
+    auto info = tile->edgeinfo(edge.e->edgeinfo_offset());
+    decode(info.encoded_shape());
+    if(decoded.empty())
+      return info;
+    //connecting another shape we dont want dups where they meet
+    auto skip = points.empty() ? 0 : 1;
+    //this shape runs the other way
+    if(edge.e->forward())
+      points.insert(points.end(), decoded.cbegin() + skip, decoded.cend());
+    else
+      points.insert(points.end(), decoded.crbegin() + skip, decoded.crend());
+    return info;
+  }
+  //polyline encode the points at 1e-6 precision, lat first, same as midgard::encode
+  const std::string& encode() {
+    encoded.clear();
+    int32_t lat = 0, lng = 0;
+    for(const auto& p : points) {
+      serialize(p.first - lat);
+      serialize(p.second - lng);
+      lat = p.first;
+      lng = p.second;
+    }
+    return encoded;
+  }
+  //lat,lng pairs
+  std::vector<std::pair<int32_t, int32_t> > points;
+protected:
+  //7 bits at a time with the sign down in the lowest bit, same as midgard::decode7 minus the floats
+  void decode(const std::string& shape) {
+    decoded.clear();
+    auto begin = shape.cbegin(), end = shape.cend();
+    auto deserialize = [&begin, &end](int32_t previous) {
+      uint32_t byte, shift = 0, result = 0;
+      do {
+        if(begin == end)
+          throw std::runtime_error("Bad encoded polyline");
+        byte = static_cast<unsigned char>(*begin++);
+        result |= (byte & 0x7f) << shift;
+        shift += 7;
+      } while(byte & 0x80);
+      return previous + static_cast<int32_t>(result & 1 ? ~(result >> 1) : result >> 1);
+    };
+    int32_t lat = 0, lng = 0;
+    while(begin != end) {
+      lat = deserialize(lat);
+      lng = deserialize(lng);
+      decoded.emplace_back(lat, lng);
+    }
+  }
+  //5 bits at a time offset into printable characters
+  void serialize(int32_t number) {
+    uint32_t value = number < 0 ? ~(static_cast<uint32_t>(number) << 1) : static_cast<uint32_t>(number) << 1;
+    while(value >= 0x20) {
+      encoded.push_back(static_cast<char>((0x20 | (value & 0x1f)) + 63));
+      value >>= 5;
+    }
+    encoded.push_back(static_cast<char>(value + 63));
+  }
+  std::vector<std::pair<int32_t, int32_t> > decoded;
+  std::string encoded;
+};
+
+//what the extra columns say about a path, accumulated edge by edge
+struct attributes_t {
+  void clear() {
+    length = weight = speed = 0;
+    road_class = RoadClass::kServiceOther;
+    way_ids.clear();
+  }
+  void add(const DirectedEdge* edge, uint64_t way_id) {
+    length += edge->length();
+    //speed is weighted by length but even a zero length edge counts for something
+    auto edge_weight = std::max(edge->length(), 1u);
+    weight += edge_weight;
+    speed += static_cast<uint64_t>(edge->speed()) * edge_weight;
+    road_class = std::min(road_class, edge->classification());
+    //a way is usually several edges in a row
+    if(way_ids.empty() || way_ids.back() != way_id)
+      way_ids.push_back(way_id);
+  }
+  uint32_t kph() const {
+    return weight ? (speed + weight / 2) / weight : 0;
+  }
+  uint32_t length;
+  //the most important class along the path
+  RoadClass road_class;
+  std::vector<uint64_t> way_ids;
+protected:
+  uint64_t weight, speed;
+};
+
+//read just the fixed size header off the front of a tile rather than loading the whole thing
+bool read_header(const TileHierarchy& hierarchy, const GraphId& tile_id, GraphTileHeader& header) {
+  auto file_name = hierarchy.tile_dir() + "/" + GraphTile::FileSuffix(tile_id, hierarchy);
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if(fd == -1)
+    return false;
+  auto size = pread(fd, &header, sizeof(header), 0);
+  close(fd);
+  return size == sizeof(header);
+}
+
+//a run of tile ids on one level and how many edges each of those tiles has, those that dont exist are skipped
+struct count_job_t {
+  uint8_t level;
+  uint32_t begin, end;
+  std::vector<std::pair<GraphId, uint32_t> > counts;
+};
+
+//count the edges of whichever runs of tiles nobody else has taken yet
+void count_edges(const boost::property_tree::ptree& pt, std::vector<count_job_t>& jobs, std::atomic<size_t>& next) {
+  GraphReader reader(pt.get_child("mjolnir"));
+  const auto& hierarchy = reader.GetTileHierarchy();
+  GraphTileHeader header;
+  for(auto j = next++; j < jobs.size(); j = next++) {
+    auto& job = jobs[j];
+    for(uint32_t i = job.begin; i < job.end; ++i) {
+      GraphId tile_id{i, job.level, 0};
+      if(read_header(hierarchy, tile_id, header)) {
+        job.counts.emplace_back(tile_id, header.directededgecount());
+      }
+      //we couldnt get at the file directly but the reader may still know how to get it
+      else if(reader.DoesTileExist(tile_id)) {
+        const auto* tile = reader.GetGraphTile(tile_id);
+        job.counts.emplace_back(tile_id, tile->header()->directededgecount());
+        reader.Clear();
+      }
+    }
+  }
+}
+
+//the binary output is a header followed by blocks of rows, each block stores its rows column by column,
+//and ends with the dictionary of names the blocks refer to. everything is little endian
+//  header:     "VEXB" uint32 version, uint32 extra columns, uint8 id of each extra column (see column_t)
+//  block:      'B' uint32 rows, then 6 columns each of which is a uint64 byte length followed by the data:
+//              uint32 points per row, int32 lat,lng pairs in 1e-6 degrees where all but the first point of a row
+//              are deltas from the point before, uint32 names per row, uint32 name ids, uint32 edges per row,
+//              uint64 edge GraphIds. then the extra columns in the same way and in the order of the header:
+//              speed is uint32 kph per row, length is uint32 meters per row, way ids are uint32 ways per row
+//              followed by a second column of uint64 way ids, class is uint8 road class per row
+//  dictionary: 'D' uint32 names, then for each name uint32 length followed by its bytes
+constexpr uint32_t kBinaryVersion = 2;
+constexpr size_t kBlockBytes = 8 * 1024 * 1024;
+
+//names are shared by all threads so each one only gets stored once
+struct name_dictionary_t {
+  //interns all the names of a road under the one lock
+  void intern(const std::vector<std::string>& road_names, std::vector<uint32_t>& road_ids) {
+    road_ids.clear();
+    std::lock_guard<std::mutex> lock(mutex);
+    for(const auto& name : road_names) {
+      auto inserted = ids.emplace(name, static_cast<uint32_t>(names.size()));
+      if(inserted.second)
+        names.push_back(name);
+      road_ids.push_back(inserted.first->second);
+    }
+  }
+  std::string serialize() const {
+    std::string out(1, 'D');
+    append(out, static_cast<uint32_t>(names.size()));
+    for(const auto& name : names) {
+      append(out, static_cast<uint32_t>(name.size()));
+      out.append(name);
+    }
+    return out;
+  }
+  template <class T>
+  static void append(std::string& out, const T& value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+protected:
+  std::mutex mutex;
+  std::unordered_map<std::string, uint32_t> ids;
+  std::vector<std::string> names;
+};
+
+//the rows a thread has exported but not yet written, column by column
+struct binary_block_t {
+  void add(const shape_t& shape, const std::vector<uint32_t>& name_ids, const std::list<GraphId>& edges,
+           const attributes_t& attributes) {
+    ++rows;
+    point_counts.push_back(shape.points.size());
+    int32_t lat = 0, lng = 0;
+    for(const auto& p : shape.points) {
+      points.push_back(p.first - lat);
+      points.push_back(p.second - lng);
+      lat = p.first;
+      lng = p.second;
+    }
+    name_counts.push_back(name_ids.size());
+    names.insert(names.end(), name_ids.cbegin(), name_ids.cend());
+    edge_counts.push_back(edges.size());
+    for(const auto& e : edges)
+      edge_ids.push_back(e.value);
+    for(auto column : columns) {
+      switch(column) {
+        case column_t::kSpeed: speeds.push_back(attributes.kph()); break;
+        case column_t::kLength: lengths.push_back(attributes.length); break;
+        case column_t::kWayIds:
+          way_counts.push_back(attributes.way_ids.size());
+          way_ids.insert(way_ids.end(), attributes.way_ids.cbegin(), attributes.way_ids.cend());
+          break;
+        case column_t::kClass: road_classes.push_back(static_cast<uint8_t>(attributes.road_class)); break;
+      }
+    }
+  }
+  size_t bytes() const {
+    return (point_counts.size() + points.size() + name_counts.size() + names.size() + edge_counts.size() +
+      speeds.size() + lengths.size() + way_counts.size()) * 4 + (edge_ids.size() + way_ids.size()) * 8 +
+      road_classes.size();
+  }
+  //one writev for the whole block
+  void write(int fd) {
+    if(rows == 0)
+      return;
+    char tag = 'B';
+    std::vector<std::pair<const void*, uint64_t> > data{
+      {point_counts.data(), point_counts.size() * 4}, {points.data(), points.size() * 4},
+      {name_counts.data(), name_counts.size() * 4}, {names.data(), names.size() * 4},
+      {edge_counts.data(), edge_counts.size() * 4}, {edge_ids.data(), edge_ids.size() * 8}};
+    for(auto column : columns) {
+      switch(column) {
+        case column_t::kSpeed: data.emplace_back(speeds.data(), speeds.size() * 4); break;
+        case column_t::kLength: data.emplace_back(lengths.data(), lengths.size() * 4); break;
+        case column_t::kWayIds:
+          data.emplace_back(way_counts.data(), way_counts.size() * 4);
+          data.emplace_back(way_ids.data(), way_ids.size() * 8);
+          break;
+        case column_t::kClass: data.emplace_back(road_classes.data(), road_classes.size()); break;
+      }
+    }
+    std::vector<iovec> iov{{&tag, 1}, {&rows, sizeof(rows)}};
+    size_t total = 1 + sizeof(rows);
+    for(auto& column : data) {
+      iov.push_back({&column.second, sizeof(column.second)});
+      iov.push_back({const_cast<void*>(column.first), column.second});
+      total += sizeof(column.second) + column.second;
+    }
+    if(writev(fd, iov.data(), iov.size()) != static_cast<ssize_t>(total))
+      throw std::runtime_error("Failed to write block");
+    rows = 0;
+    point_counts.clear(); points.clear(); name_counts.clear(); names.clear(); edge_counts.clear(); edge_ids.clear();
+    speeds.clear(); lengths.clear(); way_counts.clear(); way_ids.clear(); road_classes.clear();
+  }
+protected:
+  uint32_t rows = 0;
+  std::vector<uint32_t> point_counts;
+  std::vector<int32_t> points;
+  std::vector<uint32_t> name_counts, names, edge_counts;
+  std::vector<uint64_t> edge_ids;
+  std::vector<uint32_t> speeds, lengths, way_counts;
+  std::vector<uint64_t> way_ids;
+  std::vector<uint8_t> road_classes;
+};
+
+//a contiguous run of tiles, and where their edges start in the global numbering
+using tile_range_t = std::pair<std::vector<std::pair<GraphId, uint64_t> >::const_iterator,
+                               std::vector<std::pair<GraphId, uint64_t> >::const_iterator>;
+
+//export the roads that start in a range of tiles, they may well wander into other threads' tiles
+void export_tiles(const boost::property_tree::ptree& pt, const tile_index_t& tile_index,
+                  tile_range_t range, bitset_t& edge_set, uint64_t edge_count, std::atomic<uint64_t>& set,
+                  std::atomic<int>& progress, name_dictionary_t& dictionary, FILE* out) {
+  //every thread needs its own reader
+  GraphReader reader(pt.get_child("mjolnir"));
+  binary_block_t block;
+  shape_t shape;
+  attributes_t attributes;
+  std::string row;
+  std::vector<uint32_t> name_ids;
+
+  //for each tile
+  for(auto tile_count_pair = range.first; tile_count_pair != range.second; ++tile_count_pair) {
+    //for each edge in the tile
+    reader.Clear();
+    const auto* tile = reader.GetGraphTile(tile_count_pair->first);
+    for(uint32_t i = 0; i < tile->header()->directededgecount(); ++i) {
+      //we've seen this one already
+      if(edge_set.get(tile_count_pair->second + i))
+        continue;
+
+      //TODO: dont mark transition edges since we may need to use them to change levels multiple times
+      //maybe we should mark them though once every normal edge connected there has been marked
+
+      //these wont have opposing edges that we care about
+      edge_t edge{tile_count_pair->first, tile->directededge(i)};
+      edge.i.fields.id = i;
+      if(edge.e->trans_up() || edge.e->use() == Use::kTransitConnection ||
+         edge.e->trans_down() || edge.e->IsTransitLine()) { //these 2 should never happen
+        if(edge_set.set(tile_count_pair->second + i))
+          ++set;
+        continue;
+      }
+
+      //make sure we dont ever look at this or the opposing edge again, unless someone else got there first
+      edge_t opposing_edge = opposing(reader, tile, edge);
+      if(!claim(tile_index, edge_set, edge, opposing_edge))
+        continue;
+      set += 2;
+
+      //shortcuts arent real and maybe we dont want this kind of edge
+      if(edge.e->shortcut() || !filter(edge.e))
+        continue;
+
+      //no name no thanks
+      auto edge_info = tile->edgeinfo(edge.e->edgeinfo_offset());
+      auto names = edge_info.GetNames();
+      if(names.size() == 0 && !unnamed)
+        continue;
+
+      //either take the whole like named component this edge is part of and cut it up into the longest
+      //linestrings we can or just greedily walk as far as we can in both directions from this edge
+      std::vector<std::list<GraphId> > paths;
+      if(!greedy) {
+        paths = chains(component(tile_index, edge_set, reader, edge, opposing_edge, names, set));
+        //the component may have been big enough that the reader let go of this tile
+        tile = reader.GetGraphTile(tile_count_pair->first);
+      }
+      else {
+        //keep some state about this section of road
+        const auto* t = tile;
+        std::list<GraphId> edges {edge};
+
+        //go forward, next claims what it hands back
+        while((edge = next(tile_index, edge_set, reader, t, edge, names))) {
+          set += 2;
+          //keep this
+          edges.push_back(edge);
+        }
+
+        //go backward
+        edge = opposing_edge;
+        while((edge = next(tile_index, edge_set, reader, t, edge, names))) {
+          set += 2;
+          //keep this
+          edges.push_front(opposing(reader, t, edge));
+        }
+        paths.emplace_back(std::move(edges));
+      }
+
+      //every path of this road has the same names so they only need looking up the once
+      if(binary)
+        dictionary.intern(names, name_ids);
+      for(const auto& edges : paths) {
+        //get the shape and whatever else we want to say about it
+        shape.clear();
+        attributes.clear();
+        const auto* t = tile;
+        for(const auto& id : edges) {
+          if(id.Tile_Base() != t->id())
+            t = reader.GetGraphTile(id);
+          edge_t e{id, t->directededge(id)};
+          auto info = shape.extend(t, e);
+          if(columns.size())
+            attributes.add(e.e, info.wayid());
+        }
+
+        //output it, binary goes out a block at a time
+        if(binary) {
+          block.add(shape, name_ids, edges, attributes);
+          if(block.bytes() >= kBlockBytes)
+            block.write(fileno(out));
+          continue;
+        }
+        row = shape.encode();
+        row += column_separator;
+        for(auto column : columns) {
+          switch(column) {
+            case column_t::kSpeed: row += std::to_string(attributes.kph()); break;
+            case column_t::kLength: row += std::to_string(attributes.length); break;
+            case column_t::kWayIds:
+              for(const auto& way_id : attributes.way_ids)
+                row += (&way_id == &attributes.way_ids.front() ? "" : ",") + std::to_string(way_id);
+              break;
+            case column_t::kClass: row += kRoadClasses[static_cast<uint8_t>(attributes.road_class)]; break;
+          }
+          row += column_separator;
+        }
+        for(const auto& name : names) {
+          row += name;
+          if(&name != &names.back())
+            row += column_separator;
+        }
+        row += row_separator;
+        fwrite(row.data(), 1, row.size(), out);
+      }
+    }
+
+    //check progress, whichever thread gets there first says so
+    int procent = (100.f * set) / edge_count;
+    int previous = progress;
+    while(procent > previous) {
+      if(progress.compare_exchange_weak(previous, procent)) {
+        LOG_INFO(std::to_string(procent) + "%");
+        break;
+      }
+    }
+  }
+  block.write(fileno(out));
 }
 
 }
@@ -130,6 +836,15 @@ int main(int argc, char *argv[]) {
       ("row,r", bpo::value<std::string>(&column_separator), "What separator to use between row [default=\\n].")
       ("ferries,f", "Export ferries as well [default=false]")
       ("unnamed,u", "Export unnamed edges as well [default=false]")
+      ("greedy,g", "Greedily walk each road from the first edge found rather than cutting each like named "
+       "component into the longest linestrings [default=false]")
+      ("binary,b", "Write blocks of columns with a dictionary of names rather than text rows [default=false]")
+      ("concurrency,j", bpo::value<unsigned int>(&num_threads), "Number of threads to use [default=all cores].")
+      ("filter,F", bpo::value<std::string>(), "Which edges to export, for example use=road,ramp;class=motorway,trunk;"
+       "access=auto,truck. Uses, classes and access modes are named as in valhalla but lower case with underscores "
+       "and anything left out isnt filtered on [default=everything but ferries]")
+      ("columns,a", bpo::value<std::string>(), "Extra columns to output between the shape and the names, any of "
+       "speed,length,way_ids,class in the order given [default=none]")
       // positional arguments
       ("config", bpo::value<std::string>(&config), "Valhalla configuration file [required]");
 
@@ -158,8 +873,23 @@ int main(int argc, char *argv[]) {
     return EXIT_SUCCESS;
   }
 
-  bool ferries = vm.count("ferries");
-  bool unnamed = vm.count("unnamed");
+  ferries = vm.count("ferries");
+  try {
+    if(vm.count("filter"))
+      filter = parse_filter(vm["filter"].as<std::string>());
+    if(vm.count("columns"))
+      columns = parse_columns(vm["columns"].as<std::string>());
+  }
+  catch(const std::exception& e) {
+    std::cerr << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+  if(ferries)
+    filter.uses |= static_cast<uint64_t>(1) << static_cast<uint8_t>(Use::kFerry);
+  unnamed = vm.count("unnamed");
+  binary = vm.count("binary");
+  greedy = vm.count("greedy");
+  num_threads = std::max(num_threads, 1u);
 
   //parse the config
   boost::property_tree::ptree pt;
@@ -174,125 +904,95 @@ int main(int argc, char *argv[]) {
   //keep the global number of edges encountered at the point we encounter each tile
   //this allows an edge to have a sequential global id and makes storing it very small
   LOG_INFO("Enumerating edges...");
-  std::unordered_map<GraphId, uint64_t> tile_set(kMaxGraphTileId * reader.GetTileHierarchy().levels().size());
-  uint64_t edge_count = 0;
-  for(const auto& level : reader.GetTileHierarchy().levels()) {
-    for(uint32_t i = 0; i < level.second.tiles.TileCount(); ++i) {
-      GraphId tile_id{i, level.first, 0};
-      if(reader.DoesTileExist(tile_id)) {
-        //TODO: just read the header, parsing the whole thing isnt worth it at this point
-        tile_set.emplace(tile_id, edge_count);
-        const auto* tile = reader.GetGraphTile(tile_id);
-        edge_count += tile->header()->directededgecount();
-        reader.Clear();
-      }
+  //only the headers are read. the levels differ in size by orders of magnitude so each one is cut into
+  //a run of tile ids per thread and the threads take whichever run is next, the runs are put back
+  //together in order so the numbering goes level by level and tile by tile however the work was split
+  const auto& levels = reader.GetTileHierarchy().levels();
+  std::vector<count_job_t> jobs;
+  for(const auto& level : levels) {
+    uint32_t tile_count = level.second.tiles.TileCount();
+    for(uint32_t i = 0; i < num_threads; ++i) {
+      auto begin = static_cast<uint32_t>(static_cast<uint64_t>(tile_count) * i / num_threads);
+      auto end = static_cast<uint32_t>(static_cast<uint64_t>(tile_count) * (i + 1) / num_threads);
+      if(begin < end)
+        jobs.push_back({level.first, begin, end, {}});
     }
   }
+  std::atomic<size_t> next_job(0);
+  std::vector<std::thread> counters;
+  for(size_t i = 0; i < num_threads; ++i)
+    counters.emplace_back(count_edges, std::cref(pt), std::ref(jobs), std::ref(next_job));
+  for(auto& counter : counters)
+    counter.join();
+  //prefix sum the counts so any edge id maps straight to its global number, and keep a list of the
+  //tiles that exist in that same order to hand out to the threads
+  tile_index_t tile_index;
+  std::vector<std::pair<GraphId, uint64_t> > tiles;
+  auto job = jobs.cbegin();
+  for(const auto& level : levels) {
+    std::vector<std::pair<GraphId, uint32_t> > counts;
+    for(; job != jobs.cend() && job->level == level.first; ++job)
+      counts.insert(counts.end(), job->counts.cbegin(), job->counts.cend());
+    tile_index.add_level(level.first, level.second.tiles.TileCount(), counts);
+    for(const auto& tile : counts)
+      tiles.emplace_back(tile.first, tile_index(tile.first));
+  }
+  auto edge_count = tile_index.edge_count;
 
   //this is how we know what i've touched and what we havent
   bitset_t edge_set(edge_count);
 
-  //TODO: we could parallelize this and it might be quite a bit faster but if we really want to maximize
-  //continuous edges we need to avoid the lady and the tramp scenario where two threads are consuming the same
-  //stretch of road at the same time
-
-  //for each tile
-  LOG_INFO("Exporting " + std::to_string(edge_count) + " edges");
-  int progress = -1;
-  uint64_t set = 0;
-  for(const auto& tile_count_pair : tile_set) {
-    //for each edge in the tile
-    reader.Clear();
-    const auto* tile = reader.GetGraphTile(tile_count_pair.first);
-    for(uint32_t i = 0; i < tile->header()->directededgecount(); ++i) {
-      //we've seen this one already
-      if(edge_set.get(tile_count_pair.second + i))
-        continue;
-
-      //TODO: dont mark transition edges since we may need to use them to change levels multiple times
-      //maybe we should mark them though once every normal edge connected there has been marked
-
-      //make sure we dont ever look at this again
-      edge_t edge{tile_count_pair.first, tile->directededge(i)};
-      edge.i.fields.id = i;
-      edge_set.set(tile_count_pair.second + i);
-      ++set;
-
-      //these wont have opposing edges that we care about
-      if(edge.e->trans_up() || edge.e->use() == Use::kTransitConnection ||
-         edge.e->trans_down() || edge.e->IsTransitLine()) //these 2 should never happen
-        continue;
-
-      //get the opposing edge as well
-      edge_t opposing_edge = opposing(reader, tile, edge);
-      edge_set.set(tile_set.find(opposing_edge.i.Tile_Base())->second + opposing_edge.i.id());
-      ++set;
-
-      //shortcuts arent real and maybe we dont want ferries
-      if(edge.e->shortcut() || (!ferries && edge.e->use() == Use::kFerry))
-        continue;
-
-      //no name no thanks
-      auto edge_info = tile->edgeinfo(edge.e->edgeinfo_offset());
-      auto names = edge_info.GetNames();
-      if(names.size() == 0 && !unnamed)
-        continue;
-
-      //TODO: at this point we need to traverse the graph from this edge to build a subgraph of like-named
-      //connected edges. what we would like is that from that subgraph we extract linestrings which are of
-      //the maximum length. this makes people's lives easier downstream. finding such segments is NP-Hard
-      //and indeed even verifying a solution is NP-Complete. there are some tricks though.. you can do this
-      //in linear time if your subgraph is a DAG. this can't be guaranteed in the overall graph, but we can
-      //create the subgraphs in such a way that they are DAGs. this can produce suboptimal results however
-      //and depends on the initial edge. so for now we'll just greedily export edges
-
-      //keep some state about this section of road
-      std::list<edge_t> edges {edge};
-
-      //go forward
-      const auto* t = tile;
-      while((edge = next(tile_set, edge_set, reader, t, edge, names))) {
-        //mark them to never be used again
-        edge_set.set(tile_set.find(edge.i.Tile_Base())->second + edge.i.id());
-        edge_t other = opposing(reader, t, edge);
-        edge_set.set(tile_set.find(other.i.Tile_Base())->second + other.i.id());
-        set += 2;
-        //keep this
-        edges.push_back(edge);
-      }
-
-      //go backward
-      edge = opposing_edge;
-      while((edge = next(tile_set, edge_set, reader, t, edge, names))) {
-        //mark them to never be used again
-        edge_set.set(tile_set.find(edge.i.Tile_Base())->second + edge.i.id());
-        edge_t other = opposing(reader, t, edge);
-        edge_set.set(tile_set.find(other.i.Tile_Base())->second + other.i.id());
-        set += 2;
-        //keep this
-        edges.push_front(other);
-      }
-
-      //get the shape
-      std::list<PointLL> shape;
-      for(const auto& e : edges)
-        extend(reader, t, e, shape);
-
-      //output it
-      auto encoded = encode(shape);
-      std::cout << encoded << column_separator;
-      for(const auto& name : names)
-        std::cout << name << (&name == &names.back() ? "" : column_separator);
-      std::cout << row_separator;
-      std::cout.flush();
+  //cut the tiles up into one contiguous run per thread with about the same number of edges in each. tile ids
+  //go row by row so each run is a band of the world. it's still possible for two threads to work their way
+  //along the same stretch of road at once from either end, but each edge can only be claimed once so the worst
+  //that happens is that the road comes out in two pieces
+  std::vector<tile_range_t> ranges;
+  auto begin = tiles.cbegin();
+  for(size_t i = 1; i <= num_threads; ++i) {
+    auto end = i == num_threads ? tiles.cend() : std::lower_bound(begin, tiles.cend(), edge_count * i / num_threads,
+      [](const std::pair<GraphId, uint64_t>& tile, uint64_t edges) { return tile.second < edges; });
+    ranges.emplace_back(begin, end);
+    begin = end;
+  }
 
+  //each thread writes to its own file and when they are all done we stick them together
+  LOG_INFO("Exporting " + std::to_string(edge_count) + " edges with " + std::to_string(num_threads) + " threads");
+  std::atomic<uint64_t> set(0);
+  std::atomic<int> progress(-1);
+  name_dictionary_t dictionary;
+  std::vector<std::unique_ptr<FILE, int(*)(FILE*)> > outputs;
+  std::vector<std::thread> threads;
+  for(const auto& range : ranges) {
+    outputs.emplace_back(std::tmpfile(), &fclose);
+    if(!outputs.back()) {
+      LOG_ERROR("Unable to create a temporary file for output");
+      return EXIT_FAILURE;
     }
-
-    //check progress
-    int procent = (100.f * set) / edge_count;
-    if(procent > progress)
-      LOG_INFO(std::to_string(progress = procent) + "%");
+    threads.emplace_back(export_tiles, std::cref(pt), std::cref(tile_index), range, std::ref(edge_set), edge_count,
+                         std::ref(set), std::ref(progress), std::ref(dictionary), outputs.back().get());
+  }
+  for(auto& thread : threads)
+    thread.join();
+  if(binary) {
+    std::cout.write("VEXB", 4);
+    std::cout.write(reinterpret_cast<const char*>(&kBinaryVersion), sizeof(kBinaryVersion));
+    uint32_t column_count = columns.size();
+    std::cout.write(reinterpret_cast<const char*>(&column_count), sizeof(column_count));
+    for(auto column : columns)
+      std::cout.put(static_cast<char>(column));
+  }
+  std::vector<char> buffer(1 << 20);
+  for(const auto& output : outputs) {
+    rewind(output.get());
+    size_t size;
+    while((size = fread(buffer.data(), 1, buffer.size(), output.get())))
+      std::cout.write(buffer.data(), size);
+  }
+  if(binary) {
+    auto names = dictionary.serialize();
+    std::cout.write(names.data(), names.size());
   }
+  std::cout.flush();
   LOG_INFO("Done");
 
   for(uint64_t i = 0; i < edge_count; ++i) {
@@ -0,0 +1,294 @@
+#include "test.h"
+#include "association_io.h"
+
+#include <valhalla/baldr/graphtile.h>
+
+#include <boost/filesystem.hpp>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+using namespace association;
+
+namespace {
+
+// a scratch directory of graph tiles, removed again when the test is done with it
+struct scratch_t {
+  scratch_t()
+    : root(bfs::temp_directory_path() / bfs::unique_path("association_io_%%%%-%%%%-%%%%")),
+      hierarchy(root.string()), journal((root / "journal").string()) {
+    bfs::create_directories(root);
+  }
+  ~scratch_t() {
+    bfs::remove_all(root);
+  }
+  bfs::path root;
+  vb::TileHierarchy hierarchy;
+  std::string journal;
+};
+
+std::string slurp(const std::string& file_name) {
+  std::ifstream in(file_name, std::ios::binary);
+  return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+void spit(const std::string& file_name, const std::string& data, bool append = false) {
+  bfs::create_directories(bfs::path(file_name).parent_path());
+  std::ofstream out(file_name, std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+  out << data;
+}
+
+std::string tile_file(const std::string& tile_dir, const vb::GraphId& tile_id, const vb::TileHierarchy& hierarchy) {
+  return (bfs::path(tile_dir) / vb::GraphTile::FileSuffix(tile_id, hierarchy)).string();
+}
+
+const vb::GraphId kTile(1234, 2, 0);
+
+void write_records(journal_t& journal) {
+  journal.done(kTile, {kTile, vb::GraphId(1235, 2, 0)},
+               {leftover{vb::GraphId(1235, 2, 7), vb::GraphId(99, 2, 3), true, false}},
+               {partial_chunk{vb::GraphId(1235, 2, 8), vb::GraphId(99, 2, 3), 0.25f, 0.75f, false, true}});
+  journal.flushed(vb::GraphId(1235, 2, 0), 1);
+  journal.copied_forward();
+  journal.hashed(vb::GraphId(1236, 2, 0), 0xfedcba9876543210ull);
+}
+
+void test_journal_round_trip() {
+  scratch_t scratch;
+  {
+    journal_t journal(scratch.journal, false);
+    write_records(journal);
+    test::assert_bool(journal.done_count() == 1, "One osmlr tile should be done");
+  }
+
+  journal_t journal(scratch.journal, true);
+  test::assert_bool(journal.done_count() == 1, "Resuming should count what was done");
+  test::assert_bool(journal.finished.size() == 1, "Expected one finished osmlr tile");
+  const auto& done = journal.finished.front();
+  test::assert_bool(done.source == kTile, "Wrong source tile");
+  test::assert_bool(done.targets.size() == 2 && done.targets[1] == vb::GraphId(1235, 2, 0), "Wrong targets");
+  test::assert_bool(done.leftovers.size() == 1, "Expected one leftover");
+  const auto& association = done.leftovers.front();
+  test::assert_bool(association.edge == vb::GraphId(1235, 2, 7) && association.segment == vb::GraphId(99, 2, 3) &&
+                    association.starts && !association.ends, "Leftover didnt survive the round trip");
+  test::assert_bool(done.partials.size() == 1, "Expected one partial");
+  const auto& chunk = done.partials.front();
+  test::assert_bool(chunk.edge == vb::GraphId(1235, 2, 8) && chunk.segment == vb::GraphId(99, 2, 3) &&
+                    chunk.begin == 0.25f && chunk.end == 0.75f && !chunk.starts && chunk.ends,
+                    "Partial didnt survive the round trip");
+  test::assert_bool(journal.flushed_upto.size() == 1 && journal.flushed_upto.at(vb::GraphId(1235, 2, 0)) == 1,
+                    "Wrong flushed tiles");
+  test::assert_bool(journal.copied, "Copy record went missing");
+  test::assert_bool(journal.hashes.size() == 1 && journal.hashes.at(vb::GraphId(1236, 2, 0)) == 0xfedcba9876543210ull,
+                    "Hash record didnt survive the round trip");
+}
+
+void test_journal_truncation() {
+  scratch_t scratch;
+  size_t first_record;
+  {
+    journal_t journal(scratch.journal, false);
+    journal.flushed(kTile, 1);
+    first_record = bfs::file_size(scratch.journal);
+    write_records(journal);
+  }
+
+  //cut the done record short, as if the run died while writing it
+  bfs::resize_file(scratch.journal, first_record + 5);
+  {
+    journal_t journal(scratch.journal, true);
+    test::assert_bool(journal.finished.empty(), "A torn record should be dropped");
+    test::assert_bool(journal.flushed_upto.size() == 1, "The records before it should be kept");
+    test::assert_bool(bfs::file_size(scratch.journal) == first_record, "The torn record should be cut off");
+    journal.copied_forward();
+  }
+
+  //and what is appended after it reads back fine
+  journal_t journal(scratch.journal, true);
+  test::assert_bool(journal.copied && journal.flushed_upto.size() == 1, "Appending after truncation broke the journal");
+}
+
+void test_journal_header() {
+  scratch_t scratch;
+  //a journal that was never written to is just started over
+  spit(scratch.journal, "");
+  {
+    journal_t journal(scratch.journal, true);
+    test::assert_bool(journal.finished.empty(), "An empty journal has nothing in it");
+  }
+  test::assert_bool(bfs::file_size(scratch.journal) == 8, "Resuming an empty journal should give it a header");
+
+  //one from some other version cant be resumed from
+  std::string header;
+  put_u32(header, kJournalMagic);
+  put_u32(header, kJournalVersion + 1);
+  spit(scratch.journal, header);
+  test::assert_throw<std::runtime_error>([&scratch]() { journal_t journal(scratch.journal, true); },
+                                         "A journal of another version should be rejected");
+  spit(scratch.journal, "not a journal at all");
+  test::assert_throw<std::runtime_error>([&scratch]() { journal_t journal(scratch.journal, true); },
+                                         "Something that isnt a journal should be rejected");
+}
+
+partial_chunk chunk_for(uint32_t tile, uint32_t segment) {
+  return partial_chunk{vb::GraphId(tile, 2, segment), vb::GraphId(99, 2, segment), 0.0f, 0.5f, true, false};
+}
+
+void test_record_sizes() {
+  std::string data;
+  put(data, leftover{vb::GraphId(1, 2, 3), vb::GraphId(4, 2, 5), true, true});
+  test::assert_bool(data.size() == record_size<leftover>::value, "Leftovers should be a fixed size");
+  data.clear();
+  put(data, chunk_for(1, 2));
+  test::assert_bool(data.size() == record_size<partial_chunk>::value, "Partials should be a fixed size");
+}
+
+void test_run_merge_order() {
+  scratch_t scratch;
+  //three runs, two from one writer and one from another, with the same tiles in several of them
+  run_writer<partial_chunk> first((scratch.root / "first").string()), second((scratch.root / "second").string());
+  for (auto tile : {7, 3, 7, 5})
+    first.add(chunk_for(tile, tile));
+  first.flush();
+  for (auto tile : {5, 7})
+    first.add(chunk_for(tile, 100 + tile));
+  first.flush();
+  for (auto tile : {3, 3, 9})
+    second.add(chunk_for(tile, 200 + tile));
+  second.flush();
+  auto files = first.files();
+  files.insert(files.end(), second.files().begin(), second.files().end());
+  test::assert_bool(files.size() == 3, "Each flush should write a run");
+
+  //every tile comes out once, in order, with all of its records
+  run_merger<partial_chunk> merger(files);
+  std::vector<std::pair<uint64_t, size_t> > tiles;
+  uint64_t key;
+  while (merger.peek(key)) {
+    partials_t records;
+    merger.take(key, records);
+    for (const auto& record : records)
+      test::assert_bool(spill_key(record) == key, "A record came out with the wrong tile");
+    tiles.emplace_back(key, records.size());
+  }
+  std::vector<std::pair<uint64_t, size_t> > expected{
+    {vb::GraphId(3, 2, 0).value, 3}, {vb::GraphId(5, 2, 0).value, 2},
+    {vb::GraphId(7, 2, 0).value, 3}, {vb::GraphId(9, 2, 0).value, 1}};
+  std::sort(expected.begin(), expected.end());
+  test::assert_bool(tiles == expected, "Tiles should come out once each, in order, with all their records");
+}
+
+void test_run_damage() {
+  scratch_t scratch;
+  run_writer<leftover> writer((scratch.root / "run").string());
+  writer.add(leftover{vb::GraphId(1, 2, 3), vb::GraphId(4, 2, 5), true, true});
+  writer.add(leftover{vb::GraphId(2, 2, 3), vb::GraphId(4, 2, 6), false, true});
+  writer.flush();
+  auto file = writer.files().front();
+
+  //a run cut part way through a record
+  bfs::resize_file(file, bfs::file_size(file) - 1);
+  test::assert_throw<std::runtime_error>([&file]() {
+    run_merger<leftover> merger({file});
+    uint64_t key;
+    while (merger.peek(key)) {
+      leftovers_t records;
+      merger.take(key, records);
+    }
+  }, "A truncated run should be refused");
+
+  //and one from some other version
+  std::string header;
+  put_u32(header, kRunMagic);
+  put_u32(header, kRunVersion + 1);
+  spit(file, header);
+  test::assert_throw<std::runtime_error>([&file]() { run_merger<leftover> merger({file}); },
+                                         "A run of another version should be refused");
+}
+
+// where the writer of a tile is when the process is killed
+enum class crash_point { kBeforeJournal, kBeforeCommit, kAfterCommit };
+
+// write a tile the way the leftover writers do, in a child which is killed part way through
+void write_and_crash(const scratch_t& scratch, crash_point crash) {
+  auto pid = fork();
+  if (pid == 0) {
+    //whatever happens the child must not carry on into the rest of the tests
+    try {
+      journal_t journal(scratch.journal, false);
+      staging_t staging(scratch.hierarchy);
+      staging.stage(kTile, kLocalRound);
+      spit(tile_file(staging.directory(kLocalRound), kTile, scratch.hierarchy), " associated", true);
+      staging.sync(kTile, kLocalRound);
+      if (crash == crash_point::kBeforeJournal)
+        kill(getpid(), SIGKILL);
+      journal.done(kTile, {kTile}, {}, {});
+      if (crash == crash_point::kBeforeCommit)
+        kill(getpid(), SIGKILL);
+      staging.commit(kTile, kLocalRound);
+      kill(getpid(), SIGKILL);
+    }
+    catch (...) {
+    }
+    _exit(EXIT_FAILURE);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  test::assert_bool(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL, "The writer should have been killed");
+}
+
+// resume after the crash, twice, since resuming can itself be interrupted
+std::string resume_after(crash_point crash) {
+  scratch_t scratch;
+  auto live = tile_file(scratch.hierarchy.tile_dir(), kTile, scratch.hierarchy);
+  spit(live, "tile");
+  write_and_crash(scratch, crash);
+  for (int i = 0; i < 2; ++i) {
+    journal_t journal(scratch.journal, true);
+    staging_t staging(scratch.hierarchy);
+    recover(journal, staging);
+    test::assert_bool(!bfs::exists(scratch.root / kStagingName), "Recovery should clear the staging area");
+  }
+  return slurp(live);
+}
+
+void test_resume_before_journal() {
+  test::assert_bool(resume_after(crash_point::kBeforeJournal) == "tile",
+                    "A write the journal doesnt know about should be thrown away");
+}
+
+void test_resume_before_commit() {
+  test::assert_bool(resume_after(crash_point::kBeforeCommit) == "tile associated",
+                    "A journaled write should be committed exactly once");
+}
+
+void test_resume_after_commit() {
+  test::assert_bool(resume_after(crash_point::kAfterCommit) == "tile associated",
+                    "A committed write should not be applied again");
+}
+
+}
+
+int main() {
+  test::suite suite("association_io");
+
+  suite.test(TEST_CASE(test_journal_round_trip));
+  suite.test(TEST_CASE(test_journal_truncation));
+  suite.test(TEST_CASE(test_journal_header));
+  suite.test(TEST_CASE(test_record_sizes));
+  suite.test(TEST_CASE(test_run_merge_order));
+  suite.test(TEST_CASE(test_run_damage));
+  suite.test(TEST_CASE(test_resume_before_journal));
+  suite.test(TEST_CASE(test_resume_before_commit));
+  suite.test(TEST_CASE(test_resume_after_commit));
+
+  return suite.tear_down();
+}